@@ -0,0 +1,71 @@
+#ifndef SP_ATLAS_HPP
+#define SP_ATLAS_HPP
+
+#include "SDL2/SDL.h"
+
+
+/*
+ * Where every sprite sits on the sprite sheet, data/spritesheet.png, as
+ * compile time constants. Entities and the UI all draw from these single
+ * copies rather than keeping clips of their own.
+ */
+
+// Size of the bird's sprite clips
+#define BIRD_CLIP_W 17
+#define BIRD_CLIP_H 12
+
+namespace atlas {
+
+    // The wing animation, in order
+    constexpr SDL_Rect bird[4] = {
+        { 264, 64, BIRD_CLIP_W, BIRD_CLIP_H },
+        { 264, 90, BIRD_CLIP_W, BIRD_CLIP_H },
+        { 223, 124, BIRD_CLIP_W, BIRD_CLIP_H },
+        { 264, 90, BIRD_CLIP_W, BIRD_CLIP_H }
+    };
+
+    // Pipe caps, and one row of each pipe's body to stretch
+    constexpr SDL_Rect pipe_top = { 302, 123, 26, 12 };
+    constexpr SDL_Rect pipe_top_body = { 303, 0, 24, 1 };
+    constexpr SDL_Rect pipe_bottom = { 330, 0, 26, 12 };
+    constexpr SDL_Rect pipe_bottom_body = { 331, 12, 24, 1 };
+
+    constexpr SDL_Rect background = { 0, 0, 143, 255 };
+    constexpr SDL_Rect ground = { 146, 0, 154, 55 };
+
+    // The score while playing
+    constexpr SDL_Rect digits[10] = {
+        { 288, 100, 8, 10 },
+        { 288, 118, 8, 10 },
+        { 288, 134, 8, 10 },
+        { 288, 150, 8, 10 },
+        { 287, 173, 8, 10 },
+        { 287, 185, 8, 10 },
+        { 165, 245, 8, 10 },
+        { 175, 245, 8, 10 },
+        { 185, 245, 8, 10 },
+        { 195, 245, 8, 10 }
+    };
+
+    // The scores on the score board
+    constexpr SDL_Rect small_digits[10] = {
+        { 288, 74,  6, 7 },
+        { 289, 162, 6, 7 },
+        { 204, 245, 6, 7 },
+        { 212, 245, 6, 7 },
+        { 220, 245, 6, 7 },
+        { 228, 245, 6, 7 },
+        { 284, 197, 6, 7 },
+        { 292, 197, 6, 7 },
+        { 284, 213, 6, 7 },
+        { 292, 213, 6, 7 }
+    };
+
+    constexpr SDL_Rect game_over = { 146, 199, 94, 19 };
+    constexpr SDL_Rect score_board = { 146, 58, 113, 58 };
+    constexpr SDL_Rect ok_button = { 246, 134, 40, 14 };
+    constexpr SDL_Rect tap = { 160, 117, 48, 53 };
+
+}
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef SP_CAPTURE_HPP
+#define SP_CAPTURE_HPP
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <atomic>
+#include <algorithm>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "SDL2/SDL.h"
+#include "SDL2/SDL_image.h"
+
+
+namespace sp {
+
+    /**
+     * Convert a tightly packed RGBA frame to planar 4:2:0 YCbCr (full range
+     * BT.601, what Y4M calls C420jpeg). Chroma is taken from the average of
+     * each 2x2 block. Width and height must be even.
+     * @param rgba width * height * 4 bytes
+     * @param y width * height bytes
+     * @param u width * height / 4 bytes
+     * @param v width * height / 4 bytes
+     */
+    inline void rgba_to_yuv420(const uint8_t *rgba, int width, int height,
+                               uint8_t *y, uint8_t *u, uint8_t *v)
+    {
+        int n = width * height;
+        int i = 0;
+
+#ifdef __SSE2__
+        /* Each 32 bit lane holds one pixel. Masking out every other byte
+         * gives (R, B) and (G, A) as pairs of 16 bit values, so one madd
+         * each covers the weighted sum. */
+        const __m128i low = _mm_set1_epi32(0x00ff00ff);
+        const __m128i y_rb = _mm_set1_epi32((29 << 16) | 77);
+        const __m128i y_ga = _mm_set1_epi32(150);
+        const __m128i round = _mm_set1_epi32(128);
+
+        for (; i + 16 <= n; i += 16) {
+            __m128i sums[4];
+            for (int k = 0; k < 4; k++) {
+                __m128i px = _mm_loadu_si128((const __m128i *)(rgba + (i + k * 4) * 4));
+                __m128i rb = _mm_and_si128(px, low);
+                __m128i ga = _mm_and_si128(_mm_srli_epi16(px, 8), low);
+                __m128i sum = _mm_add_epi32(_mm_madd_epi16(rb, y_rb),
+                                            _mm_madd_epi16(ga, y_ga));
+                sums[k] = _mm_srli_epi32(_mm_add_epi32(sum, round), 8);
+            }
+            __m128i lo = _mm_packs_epi32(sums[0], sums[1]);
+            __m128i hi = _mm_packs_epi32(sums[2], sums[3]);
+            _mm_storeu_si128((__m128i *)(y + i), _mm_packus_epi16(lo, hi));
+        }
+#endif
+        for (; i < n; i++) {
+            const uint8_t *p = rgba + i * 4;
+            y[i] = (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+        }
+
+        int cw = width / 2;
+        for (int row = 0; row < height / 2; row++) {
+            const uint8_t *top = rgba + (size_t)(row * 2) * width * 4;
+            const uint8_t *bottom = top + width * 4;
+            uint8_t *u_row = u + row * cw;
+            uint8_t *v_row = v + row * cw;
+            int col = 0;
+
+#ifdef __SSE2__
+            const __m128i u_rb = _mm_set1_epi32((128 << 16) | (uint16_t)-43);
+            const __m128i u_ga = _mm_set1_epi32((uint16_t)-85);
+            const __m128i v_rb = _mm_set1_epi32(((uint32_t)(uint16_t)-21 << 16) | 128);
+            const __m128i v_ga = _mm_set1_epi32((uint16_t)-107);
+            const __m128i bias = _mm_set1_epi32((128 << 8) + 128);
+
+            for (; col + 4 <= cw; col += 4) {
+                __m128i a0 = _mm_loadu_si128((const __m128i *)(top + col * 8));
+                __m128i a1 = _mm_loadu_si128((const __m128i *)(top + col * 8 + 16));
+                __m128i b0 = _mm_loadu_si128((const __m128i *)(bottom + col * 8));
+                __m128i b1 = _mm_loadu_si128((const __m128i *)(bottom + col * 8 + 16));
+
+                /* Average vertically, then each pixel with its right hand
+                 * neighbour; the block averages end up in the even lanes */
+                __m128i m0 = _mm_avg_epu8(a0, b0);
+                __m128i m1 = _mm_avg_epu8(a1, b1);
+                m0 = _mm_avg_epu8(m0, _mm_srli_epi64(m0, 32));
+                m1 = _mm_avg_epu8(m1, _mm_srli_epi64(m1, 32));
+                __m128i px = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(m0),
+                                                             _mm_castsi128_ps(m1),
+                                                             _MM_SHUFFLE(2, 0, 2, 0)));
+
+                __m128i rb = _mm_and_si128(px, low);
+                __m128i ga = _mm_and_si128(_mm_srli_epi16(px, 8), low);
+
+                __m128i us = _mm_add_epi32(_mm_madd_epi16(rb, u_rb), _mm_madd_epi16(ga, u_ga));
+                __m128i vs = _mm_add_epi32(_mm_madd_epi16(rb, v_rb), _mm_madd_epi16(ga, v_ga));
+                us = _mm_srai_epi32(_mm_add_epi32(us, bias), 8);
+                vs = _mm_srai_epi32(_mm_add_epi32(vs, bias), 8);
+
+                __m128i uv = _mm_packus_epi16(_mm_packs_epi32(us, vs), _mm_setzero_si128());
+                uint8_t out[8];
+                _mm_storel_epi64((__m128i *)out, uv);
+                for (int k = 0; k < 4; k++) {
+                    u_row[col + k] = out[k];
+                    v_row[col + k] = out[4 + k];
+                }
+            }
+#endif
+            for (; col < cw; col++) {
+                int rgb[3];
+                for (int c = 0; c < 3; c++) {
+                    const uint8_t *t = top + col * 8 + c;
+                    const uint8_t *b = bottom + col * 8 + c;
+                    rgb[c] = (((t[0] + b[0] + 1) >> 1) + ((t[4] + b[4] + 1) >> 1) + 1) >> 1;
+                }
+                int cb = (-43 * rgb[0] - 85 * rgb[1] + 128 * rgb[2] + (128 << 8) + 128) >> 8;
+                int cr = (128 * rgb[0] - 107 * rgb[1] - 21 * rgb[2] + (128 << 8) + 128) >> 8;
+                u_row[col] = std::min(cb, 255);
+                v_row[col] = std::min(cr, 255);
+            }
+        }
+    }
+
+
+    /**
+     * Records rendered frames without holding up the render loop. Frames
+     * are read back into buffers from a fixed pool and handed through a
+     * bounded queue to an encoder thread, which writes them out as one
+     * Y4M file or a numbered PNG sequence and then returns the buffers to
+     * the pool. Nothing is ever dropped: if the encoder falls a whole pool
+     * behind, capture waits for it.
+     */
+    class FrameCapture
+    {
+        public:
+            /**
+             * @param path Ends in .y4m for a video, otherwise a printf
+             *        pattern for PNG file names (%06d.png is appended if
+             *        it has no %)
+             * @param fps The frame rate written into the Y4M header
+             * @param pool How many frame buffers to cycle through
+             */
+            FrameCapture(const std::string &path, int width, int height,
+                         int fps = 60, size_t pool = 8)
+                : path(path), width(width), height(height), fps(fps),
+                  frame_count(0), stopping(false)
+            {
+                y4m = path.size() > 4 && path.compare(path.size() - 4, 4, ".y4m") == 0;
+                if (!y4m && path.find('%') == std::string::npos)
+                    this->path += "%06d.png";
+
+                for (size_t i = 0; i < pool; i++)
+                    free_frames.push_back(new std::vector<uint8_t>(width * height * 4));
+
+                yuv.resize(width * height * 3 / 2);
+            }
+
+            ~FrameCapture()
+            {
+                stop();
+                for (std::vector<uint8_t> *frame : free_frames)
+                    delete frame;
+            }
+
+            bool start()
+            {
+                if (y4m) {
+                    out.open(path.c_str(), std::ios::binary | std::ios::trunc);
+                    if (out.fail()) {
+                        std::cerr << "Failed to open " << path << std::endl;
+                        return false;
+                    }
+                    out << "YUV4MPEG2 W" << width << " H" << height << " F" << fps
+                        << ":1 Ip A1:1 C420jpeg\n";
+                }
+
+                encoder = std::thread(&FrameCapture::encode, this);
+                return true;
+            }
+
+            /**
+             * Read back what the renderer has drawn so far and queue it
+             * for encoding. Call before SDL_RenderPresent.
+             */
+            bool capture(SDL_Renderer *renderer)
+            {
+                std::vector<uint8_t> *frame;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait(lock, [this] { return !free_frames.empty(); });
+                    frame = free_frames.back();
+                    free_frames.pop_back();
+                }
+
+                if (SDL_RenderReadPixels(renderer, nullptr, SDL_PIXELFORMAT_RGBA32,
+                                         frame->data(), width * 4) != 0) {
+                    std::cerr << "SDL_RenderReadPixels: " << SDL_GetError() << std::endl;
+                    std::lock_guard<std::mutex> lock(mutex);
+                    free_frames.push_back(frame);
+                    return false;
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    full_frames.push_back(frame);
+                }
+                changed.notify_all();
+                return true;
+            }
+
+            /**
+             * Finish encoding everything queued so far and close the output
+             */
+            void stop()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                }
+                changed.notify_all();
+
+                if (encoder.joinable())
+                    encoder.join();
+                if (out.is_open())
+                    out.close();
+            }
+
+            unsigned long get_frame_count() const
+            {
+                return frame_count;
+            }
+
+        private:
+            void encode()
+            {
+                for (;;) {
+                    std::vector<uint8_t> *frame;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        changed.wait(lock, [this] { return stopping || !full_frames.empty(); });
+                        if (full_frames.empty())
+                            return;
+                        frame = full_frames.front();
+                        full_frames.pop_front();
+                    }
+
+                    if (y4m)
+                        write_y4m(*frame);
+                    else
+                        write_png(*frame);
+                    frame_count++;
+
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        free_frames.push_back(frame);
+                    }
+                    changed.notify_all();
+                }
+            }
+
+            void write_y4m(const std::vector<uint8_t> &frame)
+            {
+                size_t luma = width * height;
+                rgba_to_yuv420(frame.data(), width, height, &yuv[0],
+                               &yuv[luma], &yuv[luma + luma / 4]);
+
+                out << "FRAME\n";
+                out.write((const char *)yuv.data(), yuv.size());
+            }
+
+            void write_png(std::vector<uint8_t> &frame)
+            {
+                char name[4096];
+                snprintf(name, sizeof(name), path.c_str(), (int)frame_count);
+
+                SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormatFrom(
+                        frame.data(), width, height, 32, width * 4, SDL_PIXELFORMAT_RGBA32);
+                if (surface == nullptr || IMG_SavePNG(surface, name) != 0)
+                    std::cerr << "Failed to write " << name << ": " << IMG_GetError() << std::endl;
+                SDL_FreeSurface(surface);
+            }
+
+            std::string path;
+            bool y4m;
+            int width, height, fps;
+            std::ofstream out;
+            std::vector<uint8_t> yuv;
+            std::atomic<unsigned long> frame_count;
+
+            std::mutex mutex;
+            std::condition_variable changed;
+            std::vector<std::vector<uint8_t> *> free_frames;
+            std::deque<std::vector<uint8_t> *> full_frames;
+            bool stopping;
+            std::thread encoder;
+    };
+
+}
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef SP_FIXED_HPP
+#define SP_FIXED_HPP
+
+#include <stdint.h>
+
+
+namespace sp {
+
+    /**
+     * Q16.16 fixed point number. Every operation is plain integer math on
+     * the raw 32 bit value (products and quotients go through 64 bits), so
+     * results are the same on every compiler, flag set and FPU, and loops
+     * over arrays of them are ordinary integer loops the compiler can
+     * vectorize.
+     */
+    class Fixed
+    {
+        public:
+            enum { FRACTION_BITS = 16, ONE = 1 << FRACTION_BITS };
+
+            Fixed() : raw(0) {}
+            Fixed(int value) : raw(value * ONE) {}
+
+            /**
+             * Only meant for constants; rounds to the nearest step
+             */
+            explicit Fixed(double value)
+                : raw((int32_t)(value * ONE + (value < 0 ? -0.5 : 0.5))) {}
+
+            static Fixed from_raw(int32_t raw)
+            {
+                Fixed f;
+                f.raw = raw;
+                return f;
+            }
+
+            int32_t get_raw() const
+            {
+                return raw;
+            }
+
+            /**
+             * Truncates toward zero, like a float to int cast
+             */
+            explicit operator int() const
+            {
+                return raw / ONE;
+            }
+
+            explicit operator float() const
+            {
+                return raw / (float)ONE;
+            }
+
+            explicit operator double() const
+            {
+                return raw / (double)ONE;
+            }
+
+            Fixed operator-() const
+            {
+                return from_raw(-raw);
+            }
+
+            Fixed &operator+=(Fixed b)
+            {
+                raw += b.raw;
+                return *this;
+            }
+
+            Fixed &operator-=(Fixed b)
+            {
+                raw -= b.raw;
+                return *this;
+            }
+
+            Fixed &operator*=(Fixed b)
+            {
+                raw = (int32_t)(((int64_t)raw * b.raw + ONE / 2) >> FRACTION_BITS);
+                return *this;
+            }
+
+            Fixed &operator/=(Fixed b)
+            {
+                // A multiply, since shifting a negative value left is undefined
+                raw = (int32_t)((int64_t)raw * ONE / b.raw);
+                return *this;
+            }
+
+            friend Fixed operator+(Fixed a, Fixed b) { return a += b; }
+            friend Fixed operator-(Fixed a, Fixed b) { return a -= b; }
+            friend Fixed operator*(Fixed a, Fixed b) { return a *= b; }
+            friend Fixed operator/(Fixed a, Fixed b) { return a /= b; }
+
+            friend bool operator==(Fixed a, Fixed b) { return a.raw == b.raw; }
+            friend bool operator!=(Fixed a, Fixed b) { return a.raw != b.raw; }
+            friend bool operator<(Fixed a, Fixed b)  { return a.raw < b.raw; }
+            friend bool operator>(Fixed a, Fixed b)  { return a.raw > b.raw; }
+            friend bool operator<=(Fixed a, Fixed b) { return a.raw <= b.raw; }
+            friend bool operator>=(Fixed a, Fixed b) { return a.raw >= b.raw; }
+
+        private:
+            int32_t raw;
+    };
+
+
+    /**
+     * c ? a : b, on the raw values. A conditional on Fixed objects picks
+     * which one to copy, which the vectorizer won't take; this is a plain
+     * integer select it will.
+     */
+    inline Fixed select(bool c, Fixed a, Fixed b)
+    {
+        return Fixed::from_raw(c ? a.get_raw() : b.get_raw());
+    }
+
+    inline float select(bool c, float a, float b)
+    {
+        return c ? a : b;
+    }
+
+
+    /**
+     * a * n / D with the product kept at full width and the result
+     * rounded to nearest, so scaling by small time steps doesn't lose
+     * precision or overflow. The divisor is a template argument so the
+     * divide compiles to a multiply by its reciprocal and a shift instead
+     * of a 64 bit idiv.
+     */
+    template <int D>
+    inline Fixed muldiv(Fixed a, int n)
+    {
+        int64_t p = (int64_t)a.get_raw() * n;
+        return Fixed::from_raw((int32_t)((p + (p >= 0 ? D / 2 : -D / 2)) / D));
+    }
+
+    template <int D>
+    inline float muldiv(float a, int n)
+    {
+        return a * n / D;
+    }
+
+
+    /**
+     * a * n / D like muldiv, but in 32 bit integer math only, so a loop of
+     * them vectorizes on integer SIMD lanes. n / D is split into a whole
+     * part and a fraction in 1/65536ths, which depend on n alone and so
+     * come out of a loop where n doesn't change, and a into its high and
+     * low 16 bits, so that every partial product fits in 32 bits.
+     *
+     * The fraction is rounded, so this is a little less exact than
+     * muldiv: it's for the numbers that change from step to step, while
+     * constants scaled every step (scroll speed, gravity) go through
+     * muldiv and don't drift.
+     */
+    template <int D>
+    inline Fixed scale(Fixed a, int n)
+    {
+        const int32_t whole = n / D;
+        const int32_t fraction = ((n % D) * Fixed::ONE + D / 2) / D;
+
+        const int32_t raw = a.get_raw();
+        const int32_t high = raw >> Fixed::FRACTION_BITS;
+        const uint32_t low = (uint32_t)raw & (Fixed::ONE - 1);
+        const int32_t rounded = (int32_t)((low * (uint32_t)fraction + Fixed::ONE / 2) >> Fixed::FRACTION_BITS);
+
+        return Fixed::from_raw(raw * whole + high * fraction + rounded);
+    }
+
+    template <int D>
+    inline float scale(float a, int n)
+    {
+        return a * n / D;
+    }
+
+}
+
+#endif
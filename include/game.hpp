@@ -0,0 +1,1427 @@
+#ifndef SP_GAME_HPP
+#define SP_GAME_HPP
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+
+#include "SDL2/SDL.h"
+
+#include "sdl_util.hpp"
+#include "fixed.hpp"
+#include "atlas.hpp"
+#include "telemetry.hpp"
+
+#define SCREEN_WIDTH  400
+#define SCREEN_HEIGHT 360
+#define SCREEN_DEPTH  32
+
+// World units per sprite sheet pixel. The scene is drawn at the sheet's own
+// resolution, SCENE_WIDTH x SCENE_HEIGHT, and only scaled up on present.
+#define PIXEL_SCALE   2
+#define SCENE_WIDTH   (SCREEN_WIDTH / PIXEL_SCALE)
+#define SCENE_HEIGHT  (SCREEN_HEIGHT / PIXEL_SCALE)
+
+#define NUM_OBSTACLES (SCREEN_WIDTH / 100)
+#define NUM_GROUND    (SCREEN_WIDTH / (atlas::ground.w * PIXEL_SCALE) + 1)
+#define GROUND_WIDTH  (atlas::ground.w * PIXEL_SCALE * NUM_GROUND)
+
+// Size of the bird on screen
+#define BIRD_WIDTH  38
+#define BIRD_HEIGHT 24
+
+// How long each of the bird's four wing clips shows, in milliseconds
+#define WING_FRAME_MS 60
+
+
+/**
+ * The rules of the game. The world, its entities and fly() take a rules
+ * struct as a template parameter, so these are compile time constants in
+ * every physics kernel; a different ruleset is a struct that inherits
+ * this one and overrides some of them, and gets its own kernels.
+ */
+struct ArcadeRules
+{
+    // Vertical speed a flap sets, in pixels per second
+    static constexpr int flap_speed = -265;
+    // Downward acceleration while alive and once dead, in pixels per second squared
+    static constexpr int gravity = 920;
+    static constexpr int dead_gravity = 5000;
+    // Fastest the bird falls, in pixels per second. More than it can pick
+    // up over the height of the screen, so it only ever holds back a dead
+    // bird lying on the ground, which would otherwise speed up forever
+    // and overflow sp::Fixed.
+    static constexpr int terminal_speed = 3000;
+    // How fast the pipes and ground scroll, in pixels per second
+    static constexpr int scroll_speed = 200;
+    // Height of the opening between a pair of pipes
+    static constexpr int pipe_gap = 90;
+    // Where the first pipe starts and how far apart pipes are
+    static constexpr int first_pipe_x = 600;
+    static constexpr int pipe_spacing = 200;
+};
+
+
+class Entity
+{
+    public:
+        Entity()
+        {
+            id = generate_id();
+            texture = nullptr;
+            angle = 0;
+            motion_x = 0;
+            motion_y = 0;
+        }
+
+        virtual void update(int delta) = 0;
+        virtual void draw(SDL_Renderer *renderer) = 0;
+        virtual void on_collision(Entity *ent) {};
+
+        /**
+         * The screen-space rectangle that contains everything draw() may
+         * touch. Used to skip entities that are entirely off-screen.
+         */
+        virtual SDL_Rect get_bounds() = 0;
+
+        bool operator==(const Entity &ent) const
+        {
+            return (id == ent.get_id());
+        }
+
+        const std::vector<SDL_Rect> &get_collision_rects() const
+        {
+            return collision_rects;
+        }
+
+        const int get_id() const
+        {
+            return id;
+        }
+
+        /**
+         * How far the collision rects moved during the last update.
+         * Collisions are swept along this path, so a long time step can't
+         * carry one entity straight through another.
+         */
+        void get_motion(float &dx, float &dy)
+        {
+            dx = motion_x;
+            dy = motion_y;
+        }
+
+        /**
+         * Forget the last motion, for when an entity is teleported
+         */
+        void clear_motion()
+        {
+            motion_x = 0;
+            motion_y = 0;
+        }
+
+    protected:
+        int id;
+        SDL_Texture *texture;
+        double angle;
+        float motion_x, motion_y;
+        std::vector<SDL_Rect> collision_rects;
+
+    private:
+        int generate_id()
+        {
+            static int s_nid = 0;
+            return s_nid++;
+        } 
+};
+
+
+class CollisionBank
+{
+    public:
+
+        void register_entity(Entity *entity)
+        {
+            entities.push_back(entity);
+        }
+
+        void dispatch_collisions()
+        {
+            /* N^2 does it matter for small amount of entities? */
+            uint64_t tested = 0, hit = 0;
+            for (Entity * entity_a : entities) {
+                for (Entity * entity_b : entities) {
+                    if (*entity_a == *entity_b)
+                        continue;
+
+                    float ax, ay, bx, by;
+                    entity_a->get_motion(ax, ay);
+                    entity_b->get_motion(bx, by);
+
+                    for(const SDL_Rect &rect_a : entity_a->get_collision_rects()) {
+                        for(const SDL_Rect &rect_b : entity_b->get_collision_rects()) {
+                            tested++;
+                            if (check_swept_collision(rect_a, ax - bx, ay - by, rect_b)) {
+                                hit++;
+                                entity_b->on_collision(entity_a);
+                                entity_a->on_collision(entity_b);
+                            }
+                        }
+                    }
+                }
+            }
+
+            sp::Telemetry::count(sp::Telemetry::COLLISIONS_TESTED, tested);
+            sp::Telemetry::count(sp::Telemetry::COLLISIONS_HIT, hit);
+        }
+
+        
+        static bool check_collision(SDL_Rect A, SDL_Rect B) {
+            // The sides of the rectangles
+            int leftA, leftB;
+            int rightA, rightB;
+            int topA, topB;
+            int bottomA, bottomB;
+
+            // Calculate the sides of rect A
+            leftA = A.x;
+            rightA = A.x + A.w;
+            topA = A.y;
+            bottomA = A.y + A.h;
+
+            // Calculate the sides of rect B
+            leftB = B.x;
+            rightB = B.x + B.w;
+            topB = B.y;
+            bottomB = B.y + B.h; 
+                
+            // If any of the sides from A are outside of B
+            if(bottomA <= topB) {
+                return false;
+            }
+            if(topA >= bottomB) {
+               return false;
+            }
+            if(rightA <= leftB) {
+               return false;
+            }
+            if(leftA >= rightB) {
+                return false;
+            }
+
+            // If none of the sides from A are outside B
+            return true;
+        } 
+
+        /**
+         * Swept AABB test. A is given where it ended up and got there by
+         * moving (dx, dy) relative to B over the last step; B is treated as
+         * standing still. Touching edges don't count, same as check_collision.
+         * @param A The moving rect, at its end position
+         * @param dx The horizontal distance A moved relative to B
+         * @param dy The vertical distance A moved relative to B
+         * @param B The rect to test against
+         * @param time If not null, receives the fraction of the step at
+         *        which A first touched B
+         * @return true if A overlapped B at any point during the step
+         */
+        static bool check_swept_collision(SDL_Rect A, float dx, float dy,
+                                          SDL_Rect B, float *time = nullptr)
+        {
+            float enter = 0.0f;
+            float exit = 1.0f;
+
+            if (!sweep_axis(A.x - dx, A.w, dx, B.x, B.w, enter, exit))
+                return false;
+            if (!sweep_axis(A.y - dy, A.h, dy, B.y, B.h, enter, exit))
+                return false;
+
+            if (time != nullptr)
+                *time = enter;
+
+            return true;
+        }
+
+        static  bool check_point_collision(int x, int y, SDL_Rect rect)
+        {
+            if (x >= rect.x && x <= (rect.x + rect.w) &&
+                y >= rect.y && y <= (rect.y + rect.h))
+                return true;
+            else
+                return false;
+        }
+
+    private:
+        /**
+         * Narrow [enter, exit) down to the part of the step where the two
+         * spans overlap on one axis
+         */
+        static bool sweep_axis(float a, int a_len, float d, int b, int b_len,
+                               float &enter, float &exit)
+        {
+            if (d == 0.0f)
+                return a < b + b_len && a + a_len > b;
+
+            float t0 = (b - (a + a_len)) / d;
+            float t1 = (b + b_len - a) / d;
+            if (t0 > t1)
+                std::swap(t0, t1);
+
+            enter = std::max(enter, t0);
+            exit = std::min(exit, t1);
+
+            return enter < exit;
+        }
+
+        std::vector<Entity*> entities;
+};
+
+
+/**
+ * One step of the bird's flight: gravity, the ground and the tilt. Kept
+ * apart from the bird entity so anything that only needs to replay a
+ * bird's path (ghosts) can do so with a few numbers per bird.
+ * @param y The bird's top edge
+ * @param y_v Vertical speed in pixels per second
+ * @param rotation Tilt in degrees
+ * @param delta The time step in milliseconds
+ * @return true if the bird is on the ground, which kills it
+ */
+template <typename Rules = ArcadeRules, typename Real>
+inline bool fly(Real &y, Real &y_v, Real &rotation, bool idle, bool dead, int delta)
+{
+    int acceleration = Rules::gravity;
+
+    if (dead)
+        acceleration = Rules::dead_gravity;
+
+    /* Everything is scaled by delta / 1000: constants through muldiv,
+     * which keeps the fixed point path as close to float as it can get,
+     * and the bird's own numbers through scale, which the flock version
+     * can vectorize */
+    if (!idle) {
+        y += sp::scale<1000>(y_v, delta);
+        y_v += sp::muldiv<1000>(Real(acceleration), delta);
+        if (y_v > Rules::terminal_speed)
+            y_v = Rules::terminal_speed;
+        if (y <= 0)
+            y = 0;
+    }
+
+    if (y >= SCREEN_HEIGHT - BIRD_CLIP_H - 10 - 60) {
+        y = SCREEN_HEIGHT - BIRD_CLIP_W - 10 - 60;
+        if (rotation < 90)
+            rotation += sp::scale<1000>(90 - rotation, delta * 52);
+        else
+            rotation = 90;
+        return true;
+    }
+
+    if (!idle) {
+        rotation += sp::scale<1000>(sp::scale<10>(y_v, 1) - rotation, delta * 15);
+        if (rotation >= 360 || rotation <= -360)
+            rotation = 0;
+    }
+    return false;
+}
+
+
+/**
+ * fly() for a whole flock at once, none of it idle, with each number kept
+ * in an array of its own. The loop works out both the airborne and the
+ * grounded result and selects one, so its body has no branches, and the
+ * only multiplies in it are sp::scale's 32 bit ones, so the compiler can
+ * vectorize it for sp::Fixed on integer lanes as well as for float. The
+ * numbers come out the same as from fly().
+ * @param dead Whether each bird is dead; set for any that reach the ground
+ * @param n How many birds there are
+ */
+template <typename Rules = ArcadeRules, typename Real>
+inline void fly(Real *y, Real *y_v, Real *rotation, uint8_t *dead, size_t n, int delta)
+{
+    const Real floor = Real(SCREEN_HEIGHT - BIRD_CLIP_W - 10 - 60);
+    const Real terminal = Real(Rules::terminal_speed);
+    const Real fall = sp::muldiv<1000>(Real(Rules::gravity), delta);
+    const Real dead_fall = sp::muldiv<1000>(Real(Rules::dead_gravity), delta);
+
+    for (size_t i = 0; i < n; i++) {
+        Real new_y = y[i] + sp::scale<1000>(y_v[i], delta);
+        Real new_y_v = y_v[i] + sp::select(dead[i], dead_fall, fall);
+        new_y_v = sp::select(new_y_v > terminal, terminal, new_y_v);
+        new_y = sp::select(new_y <= 0, Real(0), new_y);
+
+        Real r = rotation[i];
+        Real settle = r + sp::scale<1000>(90 - r, delta * 52);
+        settle = sp::select(r < 90, settle, Real(90));
+        Real tilt = r + sp::scale<1000>(sp::scale<10>(new_y_v, 1) - r, delta * 15);
+        tilt = sp::select((tilt >= 360) | (tilt <= -360), Real(0), tilt);
+
+        bool grounded = new_y >= SCREEN_HEIGHT - BIRD_CLIP_H - 10 - 60;
+        y[i] = sp::select(grounded, floor, new_y);
+        y_v[i] = new_y_v;
+        rotation[i] = sp::select(grounded, settle, tilt);
+        dead[i] |= grounded;
+    }
+}
+
+
+/**
+ * Advance the wing animation, which stops once the bird is dead
+ * @param frame The current sprite clip, 0 to 3
+ * @param elapsed Milliseconds since the clip last changed
+ */
+inline void flap_wings(int &frame, int &elapsed, bool dead, int delta)
+{
+    if (!dead) {
+        if (elapsed >= WING_FRAME_MS) {
+            frame = (frame + 1) % 4;
+            elapsed = 0;
+        }
+        elapsed += delta;
+    } else {
+        frame = 0;
+    }
+}
+
+
+/**
+ * Digests one tick of state for the state hash. Each word is multiplied on
+ * its own and the products summed, so the multiplies overlap rather than
+ * wait on each other and a whole world takes a few nanoseconds.
+ */
+class StateHash
+{
+    public:
+        StateHash() : sum(0), position(0) {}
+
+        void add(uint64_t value)
+        {
+            // Mixing in the position keeps two pipes that swapped places
+            // from hashing the same
+            sum += (value ^ position) * 0x9E3779B97F4A7C15ull;
+            position += 0x632BE59BD9B4E019ull;
+        }
+
+        void add(uint32_t high, uint32_t low)
+        {
+            add(((uint64_t)high << 32) | low);
+        }
+
+        /**
+         * This tick's digest chained onto the hash of every tick before it
+         */
+        uint64_t chain(uint64_t previous) const
+        {
+            uint64_t h = (previous ^ sum) * 0xD6E8FEB86659FD93ull;
+            return h ^ (h >> 32);
+        }
+
+    private:
+        uint64_t sum, position;
+};
+
+
+/**
+ * The exact bits of a physics number, so the smallest drift shows
+ */
+inline uint32_t hash_bits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+inline uint32_t hash_bits(sp::Fixed value)
+{
+    return (uint32_t)value.get_raw();
+}
+
+
+/**
+ * What killed the bird
+ */
+enum DeathCause {
+    DEATH_NONE,
+    DEATH_GROUND,
+    DEATH_TOP_PIPE,
+    DEATH_BOTTOM_PIPE
+};
+
+
+/**
+ * The bird. Real is the number type the physics runs in: float for the
+ * normal game, sp::Fixed for the deterministic mode.
+ */
+template <typename Real, typename Rules = ArcadeRules>
+class BasicFlappyFuch :public Entity
+{
+    public:
+        
+        BasicFlappyFuch(int x, int y) :Entity(), x(x), y(y)
+        {
+            current_frame = 0;
+
+            next_frame = 0;
+            y_v = 30;
+            rotation = 0;
+            angle = 0;
+
+            dead = false;
+            death_cause = DEATH_NONE;
+            score_queued = false;
+            score_count = 0;
+            flap_count = 0;
+            idle = false;
+
+            set_collision();
+        }
+
+        void flap()
+        {
+            if (!dead && !idle) {
+                y_v = Rules::flap_speed;
+                flap_count++;
+            }
+        }
+
+        SDL_Rect get_dest()
+        {
+            return collision_rects[0];
+        }
+
+        SDL_Rect get_bounds()
+        {
+            /* The sprite is drawn rotated about its center, so pad the
+             * destination out to a square that holds any rotation. */
+            SDL_Rect dest = get_dest();
+            int side = dest.w + dest.h;
+            return {
+                dest.x + dest.w / 2 - side / 2,
+                dest.y + dest.h / 2 - side / 2,
+                side,
+                side
+            };
+        }
+
+        void set_collision()
+        {
+            if (!collision_rects.empty())
+                collision_rects.pop_back();
+            collision_rects.push_back({
+                .x = (int)x,
+                .y = (int)y,
+                .w = BIRD_WIDTH,
+                .h = BIRD_HEIGHT
+            });
+        }
+
+        void draw(SDL_Renderer *renderer)
+        {
+            if (texture) {
+                sp::render_texture(renderer, texture, get_dest(),
+                                   &atlas::bird[current_frame], angle);
+            }
+        }
+
+        void update(int delta)
+        {
+            begin_update();
+            update_flight(delta);
+            end_update(delta);
+        }
+
+        /**
+         * update() in three parts, so that the flight in the middle can be
+         * swapped for flying many birds at once (BasicWorld::step_all)
+         */
+        void begin_update()
+        {
+            if (score_queued && !in_collision && !idle && !dead) {
+                score_count++;
+                score_queued = false;
+            }
+        }
+
+        void update_flight(int delta)
+        {
+            if (fly<Rules>(y, y_v, rotation, idle, dead, delta))
+                die(DEATH_GROUND);
+        }
+
+        void end_update(int delta)
+        {
+            angle = static_cast<double>(rotation);
+
+            flap_wings(current_frame, next_frame, dead, delta);
+
+            int start_y = get_dest().y;
+            set_collision();
+            motion_x = 0;
+            motion_y = get_dest().y - start_y;
+
+            in_collision = false;
+        }
+
+        void set_texture(SDL_Texture *texture)
+        {
+            this->texture = texture;
+        }
+
+        void set_idle()
+        {
+            idle = true;
+        }
+
+        void set_active()
+        {
+            idle = false;
+        }
+
+        bool is_idle()
+        {
+            return idle;
+        }
+
+        /**
+         * Kill the bird. Only the first cause sticks, so a bird that hit
+         * a pipe and then fell to the ground died on the pipe.
+         */
+        void die(DeathCause cause)
+        {
+            if (!dead)
+                death_cause = cause;
+            dead = true;
+        }
+
+        void on_collision(Entity *ent1)
+        {
+            in_collision = true;                
+        }
+
+        void score()
+        {
+            score_queued = true;
+        }
+
+        int get_score()
+        {
+            return score_count;
+        }
+
+        bool is_dead()
+        {
+            return dead;
+        }
+
+        DeathCause get_death_cause()
+        {
+            return death_cause;
+        }
+
+        /**
+         * How many flaps took effect this run
+         */
+        int get_flaps()
+        {
+            return flap_count;
+        }
+
+        void set_alive()
+        {
+            dead = false;
+            death_cause = DEATH_NONE;
+            score_count = 0;
+            flap_count = 0;
+            in_collision = false;
+            score_queued = false;
+            rotation = 0;
+            angle = 0;
+        }
+
+        void set_y(int y)
+        {
+            this->y = y;
+            set_collision();
+            clear_motion();
+        }
+
+        /**
+         * Place the sprite directly, without running any physics. Used to
+         * mirror a simulation snapshot on the render side.
+         */
+        void set_pose(float y, double angle, int frame)
+        {
+            this->y = Real(y);
+            this->rotation = Real(angle);
+            this->angle = angle;
+            current_frame = frame;
+            set_collision();
+        }
+
+        float get_x()
+        {
+            return static_cast<float>(x);
+        }
+
+        float get_y()
+        {
+            return static_cast<float>(y);
+        }
+
+        double get_angle()
+        {
+            return angle;
+        }
+
+        int get_frame()
+        {
+            return current_frame;
+        }
+
+        float get_velocity()
+        {
+            return static_cast<float>(y_v);
+        }
+
+        /**
+         * The numbers fly() works on, to copy into a flock's arrays and
+         * back out again
+         */
+        void get_flight(Real &y, Real &y_v, Real &rotation) const
+        {
+            y = this->y;
+            y_v = this->y_v;
+            rotation = this->rotation;
+        }
+
+        void set_flight(Real y, Real y_v, Real rotation)
+        {
+            this->y = y;
+            this->y_v = y_v;
+            this->rotation = rotation;
+        }
+
+        /**
+         * Fold everything that steers the bird into a state hash
+         */
+        void hash_state(StateHash &hash)
+        {
+            uint32_t flags = dead | idle << 1 | score_queued << 2 | in_collision << 3 |
+                             death_cause << 4 | current_frame << 8;
+            hash.add(hash_bits(x), hash_bits(y));
+            hash.add(hash_bits(y_v), hash_bits(rotation));
+            hash.add(score_count, flap_count);
+            hash.add(flags, next_frame);
+        }
+
+    private:
+        int current_frame;
+        Real x, y, y_v;
+        Real rotation;
+        int next_frame;
+        int score_count, flap_count;
+        bool dead, score_queued, in_collision;
+        DeathCause death_cause;
+        bool idle;
+};
+
+
+template <typename Real, typename Rules = ArcadeRules>
+class BasicObstacle :public Entity
+{
+    public:
+        
+        BasicObstacle(Real x, Real y)
+            : Entity()
+        {
+            this->x = x;
+            this->y = y;
+
+            dest_pipe_top = {
+                .x = (int)x,
+                .y = (int)y - begin,
+                .w = 26 * 2,
+                .h = 12 * 2
+            };
+
+            dest_pipe_top_body = {
+                .x = (int)x + 2,
+                .y = begin,
+                .w = 24 * 2,
+                .h = (int)y - begin
+            };
+
+            dest_pipe_bottom = {
+                .x = (int)x,
+                .y = begin + gap + (int)y + 12 * 2,
+                .w = 26 * 2,
+                .h = 12 * 2
+            };
+
+            dest_pipe_bottom_body = {
+                .x = (int)x + 2,
+                .y = begin + gap + (int)y + 12 * 4,
+                .w = 24 * 2,
+                .h = end - (begin + gap + (int)y + 12 * 4)
+            };
+
+        }
+
+        void draw(SDL_Renderer *renderer)
+        {
+            if (texture) {
+                sp::render_texture(renderer, texture, dest_pipe_top_body, &atlas::pipe_top_body);
+                sp::render_texture(renderer, texture, dest_pipe_top, &atlas::pipe_top);
+
+                sp::render_texture(renderer, texture, dest_pipe_top_body, &atlas::pipe_bottom_body);
+                sp::render_texture(renderer, texture, dest_pipe_top, &atlas::pipe_bottom);
+
+                sp::render_texture(renderer, texture, dest_pipe_bottom_body, &atlas::pipe_bottom_body);
+                sp::render_texture(renderer, texture, dest_pipe_bottom, &atlas::pipe_bottom);
+
+                sp::render_texture(renderer, texture, dest_pipe_bottom_body, &atlas::pipe_bottom_body);
+                sp::render_texture(renderer, texture, dest_pipe_bottom, &atlas::pipe_bottom);
+            }
+        }
+
+        void update(int delta)
+        {
+            int start_x = dest_pipe_top.x;
+            set_x(x - sp::muldiv<1000>(Real(Rules::scroll_speed), delta));
+            motion_x = dest_pipe_top.x - start_x;
+            motion_y = 0;
+        }
+
+        void set_x(Real x)
+        {
+            this->x = x;
+
+            dest_pipe_top.x = (int)x;
+            dest_pipe_top_body.x = (int)x + 2;
+
+            dest_pipe_bottom.x = (int)x;
+            dest_pipe_bottom_body.x = (int)x + 2;
+
+            set_collision_rects();
+        }
+        
+        void set_collision_rects()
+        {
+            if (!collision_rects.empty())
+                collision_rects.clear();
+
+            collision_rects.push_back(dest_pipe_top);
+            collision_rects.push_back(dest_pipe_top_body);
+            collision_rects.push_back(dest_pipe_bottom);
+            collision_rects.push_back(dest_pipe_bottom_body);
+
+            SDL_Rect score_rect = {
+                dest_pipe_top.x,
+                dest_pipe_top.y + dest_pipe_top.h,
+                1,
+                dest_pipe_bottom.y - dest_pipe_top.y + dest_pipe_top.h
+            };
+            
+            collision_rects.push_back(score_rect);
+        }
+
+        void set_height(int y)
+        {
+            this->y = y;
+
+            dest_pipe_top.y = y - begin;
+            dest_pipe_top_body.h = y - begin;
+
+            dest_pipe_bottom.y = begin + gap + y + 12 * 2;
+            dest_pipe_bottom_body.y = begin + gap + y + 12 * 4;
+            dest_pipe_bottom_body.h = end - (begin + gap + y + 12 * 4);
+
+            set_collision_rects();
+        }
+
+        void on_collision(Entity *entity)
+        {
+            try {
+                BasicFlappyFuch<Real, Rules> *player = dynamic_cast<BasicFlappyFuch<Real, Rules>*>(entity);
+                if (player != nullptr) {
+                    const std::vector<SDL_Rect> &player_rects = player->get_collision_rects();
+
+                    float px, py, ox, oy;
+                    player->get_motion(px, py);
+                    get_motion(ox, oy);
+
+                    for(std::vector<SDL_Rect>::iterator it =
+                         collision_rects.begin(); it < collision_rects.end() - 1; it++) {
+
+                        if (CollisionBank::check_swept_collision(player_rects[0],
+                                                                 px - ox, py - oy, *it)) {
+                            // The top pipe's cap and body come first
+                            player->die(it - collision_rects.begin() < 2 ?
+                                        DEATH_TOP_PIPE : DEATH_BOTTOM_PIPE);
+                            return;
+                        }
+                    }
+                    
+                    player->score();
+                }
+            } catch(std::bad_cast) {
+            }
+        }
+
+        void set_texture(SDL_Texture *texture)
+        {
+            this->texture = texture;
+        }
+
+        int get_width()
+        {
+            return dest_pipe_top.w;
+        }
+
+        SDL_Rect get_bounds()
+        {
+            return {
+                dest_pipe_top.x,
+                begin,
+                dest_pipe_top.w,
+                end - begin
+            };
+        }
+
+        int get_x()
+        {
+            return (int)x;
+        }
+
+        /**
+         * Where the pipe is, without rounding to a whole pixel
+         */
+        Real get_exact_x()
+        {
+            return x;
+        }
+
+        int get_height()
+        {
+            return (int)y;
+        }
+
+        void hash_state(StateHash &hash)
+        {
+            hash.add(hash_bits(x), hash_bits(y));
+        }
+
+    private:
+        // The pipes run from the top of the screen down to the ground
+        static constexpr int begin = 0;
+        static constexpr int end = SCREEN_HEIGHT - 60;
+        static constexpr int gap = Rules::pipe_gap;
+
+        SDL_Rect dest_pipe_top_body;
+        SDL_Rect dest_pipe_top;
+
+        SDL_Rect dest_pipe_bottom_body;
+        SDL_Rect dest_pipe_bottom;
+
+        Real x, y;
+};
+
+typedef BasicFlappyFuch<float> FlappyFuch;
+typedef BasicObstacle<float> Obstacle;
+
+
+enum InputType {
+    INPUT_FLAP,
+    INPUT_RESET
+};
+
+
+/**
+ * Everything the renderer needs to know about the world at one tick.
+ * Plain data so it can be copied between threads without locking.
+ */
+struct WorldSnapshot
+{
+    unsigned long tick;
+    double time;
+
+    // Ticks the current run has been going, not counting the menu or
+    // anything after the bird died
+    unsigned long run_ticks;
+
+    float player_x, player_y;
+    double player_angle;
+    int player_frame;
+    int score;
+    bool dead, idle;
+
+    // How many flaps the current run has taken and, once it's over, what
+    // ended it
+    int flaps;
+    DeathCause death_cause;
+
+    float obstacle_x[NUM_OBSTACLES];
+    int obstacle_height[NUM_OBSTACLES];
+
+    float ground_x_1, ground_x_2;
+
+    // Only for comparing runs: the bird's speed, the pipe generator's
+    // state, and every tick's state so far folded into one hash
+    float player_velocity;
+    uint64_t rng_state;
+    uint64_t state_hash;
+};
+
+
+/**
+ * Whether two snapshots would look the same, ignoring when they were taken
+ */
+inline bool same_state(const WorldSnapshot &a, const WorldSnapshot &b)
+{
+    if (a.player_y != b.player_y || a.player_angle != b.player_angle ||
+        a.player_frame != b.player_frame || a.score != b.score ||
+        a.dead != b.dead || a.idle != b.idle ||
+        a.ground_x_1 != b.ground_x_1 || a.ground_x_2 != b.ground_x_2)
+        return false;
+
+    for (int i = 0; i < NUM_OBSTACLES; i++) {
+        if (a.obstacle_x[i] != b.obstacle_x[i] ||
+            a.obstacle_height[i] != b.obstacle_height[i])
+            return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * Blend two consecutive snapshots. Values that jumped between the two
+ * (a recycled pipe, a wrapped ground strip) are taken from b as is.
+ * @param a The older snapshot
+ * @param b The newer snapshot
+ * @param alpha How far between a and b to land, from 0 to 1
+ * @param out Receives the blended snapshot
+ */
+inline void interpolate(const WorldSnapshot &a, const WorldSnapshot &b,
+                        float alpha, WorldSnapshot &out)
+{
+    out = b;
+
+    out.player_y = a.player_y + (b.player_y - a.player_y) * alpha;
+    out.player_angle = a.player_angle + (b.player_angle - a.player_angle) * alpha;
+
+    for (int i = 0; i < NUM_OBSTACLES; i++) {
+        if (a.obstacle_height[i] == b.obstacle_height[i] &&
+            a.obstacle_x[i] >= b.obstacle_x[i])
+            out.obstacle_x[i] = a.obstacle_x[i] + (b.obstacle_x[i] - a.obstacle_x[i]) * alpha;
+    }
+
+    if (a.ground_x_1 >= b.ground_x_1)
+        out.ground_x_1 = a.ground_x_1 + (b.ground_x_1 - a.ground_x_1) * alpha;
+    if (a.ground_x_2 >= b.ground_x_2)
+        out.ground_x_2 = a.ground_x_2 + (b.ground_x_2 - a.ground_x_2) * alpha;
+}
+
+
+/**
+ * The open rows of a pipe pair whose top pipe sits at the given height
+ * @param height The pipe's height, as stored in a snapshot
+ * @param top Receives the first open row, just under the top pipe's cap
+ * @param bottom Receives the first row of the bottom pipe's cap
+ */
+template <typename Rules = ArcadeRules>
+inline void pipe_gap(int height, int &top, int &bottom)
+{
+    top = height + 12 * 2;
+    bottom = top + Rules::pipe_gap;
+}
+
+
+/**
+ * A scripted player: flap whenever the bird has sunk below the middle of
+ * the next gap. Good enough to get through a few dozen pipes, which makes
+ * it handy for driving worlds without a human.
+ * @param snap The current state of the world
+ * @return true if the bird should flap now
+ */
+template <typename Rules = ArcadeRules>
+inline bool autopilot(const WorldSnapshot &snap)
+{
+    int next = -1;
+    for (int i = 0; i < NUM_OBSTACLES; i++) {
+        if (snap.obstacle_x[i] + 26 * 2 < snap.player_x)
+            continue;
+        if (next == -1 || snap.obstacle_x[i] < snap.obstacle_x[next])
+            next = i;
+    }
+
+    float target = SCREEN_HEIGHT / 2 - 60;
+    if (next != -1) {
+        int top, bottom;
+        pipe_gap<Rules>(snap.obstacle_height[next], top, bottom);
+        target = (top + bottom) / 2;
+    }
+
+    return snap.player_y > target;
+}
+
+
+/**
+ * The decimal digits of a number, most significant first. Zero has none.
+ */
+inline std::vector<int> digit_to_array(int digit)
+{
+    std::vector<int> result;
+    std::vector<int>::iterator it;
+
+    while (digit) {
+        it = result.begin();
+        result.insert(it, digit % 10);
+        digit /= 10;
+    }
+
+    return result;
+}
+
+
+/**
+ * Small xorshift generator for pipe heights. Unlike the standard engines
+ * and distributions its output is pinned down exactly, so the same seed
+ * gives the same pipes with every compiler and standard library.
+ */
+class Random
+{
+    public:
+        Random(uint64_t seed)
+        {
+            state = seed * 0x9E3779B97F4A7C15ull + 1;
+        }
+
+        uint32_t next()
+        {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            return (uint32_t)((state * 0x2545F4914F6CDD1Dull) >> 32);
+        }
+
+        /**
+         * A number in [low, high]
+         */
+        int range(int low, int high)
+        {
+            return low + (int)(((uint64_t)next() * (uint32_t)(high - low + 1)) >> 32);
+        }
+
+        uint64_t get_state() const
+        {
+            return state;
+        }
+
+    private:
+        uint64_t state;
+};
+
+
+/**
+ * What the simulation thread and other drivers need from a world,
+ * whichever number type its physics runs in.
+ */
+class WorldBase
+{
+    public:
+        virtual ~WorldBase() {}
+
+        virtual void flap() = 0;
+        virtual void reset() = 0;
+        virtual void step(int delta) = 0;
+        virtual void snapshot(WorldSnapshot &snap) = 0;
+
+        /**
+         * A hash of the state after every step so far. Two runs that
+         * ever differed by a bit, even if they came back together, have
+         * different hashes from then on.
+         */
+        virtual uint64_t get_state_hash() const = 0;
+};
+
+
+/**
+ * The simulated game: the bird, the pipes and the scrolling ground.
+ * Has no knowledge of textures, audio or timing; it only moves forward
+ * when step is called.
+ */
+template <typename Real, typename Rules = ArcadeRules>
+class BasicWorld :public WorldBase
+{
+    public:
+
+        typedef BasicFlappyFuch<Real, Rules> Bird;
+        typedef BasicObstacle<Real, Rules> Pipe;
+
+        BasicWorld(unsigned seed)
+            : player(SCREEN_WIDTH / 12, SCREEN_HEIGHT / 2 - 60),
+              generator(seed)
+        {
+            for (int i = 0; i < NUM_OBSTACLES; i++)
+                obstacles.push_back(make_obstacle(Rules::first_pipe_x + i * Rules::pipe_spacing,
+                                                  next_height()));
+
+            last = obstacles.size() - 1;
+
+            col_bank.register_entity(&player);
+            for (Entity & i : obstacles)
+                col_bank.register_entity(&i);
+
+            ground_x_1 = 0;
+            ground_x_2 = ground_x_1 + GROUND_WIDTH;
+
+            tick = 0;
+            run_ticks = 0;
+            state_hash = 0;
+
+            player.set_idle();
+        }
+
+        static Pipe make_obstacle(Real x, int height)
+        {
+            return Pipe(x, height);
+        }
+
+        void flap()
+        {
+            player.set_active();
+            player.flap();
+        }
+
+        void reset()
+        {
+            player.set_alive();
+            player.set_idle();
+            player.set_y(SCREEN_HEIGHT / 2 - 60);
+
+            for (size_t i = 0; i < obstacles.size(); i++) {
+                obstacles[i].set_x(Rules::first_pipe_x + Rules::pipe_spacing * i);
+                obstacles[i].clear_motion();
+            }
+            last = obstacles.size() - 1;
+            run_ticks = 0;
+        }
+
+        /**
+         * Advance the world. Everything moves first and the collisions are
+         * then swept over this step's motion, so a bird that hits a pipe is
+         * dead in the same step, and a long step can't carry it through a
+         * pipe or past the score gate.
+         * @param delta The time step in milliseconds
+         */
+        void step(int delta)
+        {
+            begin_step(delta);
+            player.update(delta);
+            end_step(delta);
+        }
+
+        /**
+         * Scratch arrays for step_all, kept from call to call so a steady
+         * batch doesn't allocate
+         */
+        struct Batch
+        {
+            std::vector<BasicWorld *> flying;
+            std::vector<Real> y, y_v, rotation;
+            std::vector<uint8_t> dead;
+        };
+
+        /**
+         * Step many worlds at once, with the same result as stepping each
+         * of them. Each step is split around the bird's flight: the rest
+         * runs world by world, and every bird that's off the menu is flown
+         * in one fly() over arrays, which the compiler vectorizes.
+         * @param worlds The worlds to step, each of them once
+         * @param n How many there are
+         * @param delta The time step in milliseconds
+         * @param batch Scratch space
+         */
+        static void step_all(BasicWorld *const *worlds, size_t n, int delta, Batch &batch)
+        {
+            batch.flying.clear();
+            batch.y.clear();
+            batch.y_v.clear();
+            batch.rotation.clear();
+            batch.dead.clear();
+
+            for (size_t i = 0; i < n; i++) {
+                BasicWorld *world = worlds[i];
+                world->begin_step(delta);
+                world->player.begin_update();
+
+                // The menu's bob is fly() on an idle bird, which the array
+                // version doesn't do
+                if (world->player.is_idle()) {
+                    world->player.update_flight(delta);
+                    continue;
+                }
+
+                Real y, y_v, rotation;
+                world->player.get_flight(y, y_v, rotation);
+                batch.flying.push_back(world);
+                batch.y.push_back(y);
+                batch.y_v.push_back(y_v);
+                batch.rotation.push_back(rotation);
+                batch.dead.push_back(world->player.is_dead());
+            }
+
+            fly<Rules>(batch.y.data(), batch.y_v.data(), batch.rotation.data(),
+                       batch.dead.data(), batch.flying.size(), delta);
+
+            for (size_t k = 0; k < batch.flying.size(); k++) {
+                Bird &player = batch.flying[k]->player;
+                player.set_flight(batch.y[k], batch.y_v[k], batch.rotation[k]);
+                // Only reaching the ground sets dead in there
+                if (batch.dead[k] && !player.is_dead())
+                    player.die(DEATH_GROUND);
+            }
+
+            for (size_t i = 0; i < n; i++) {
+                worlds[i]->player.end_update(delta);
+                worlds[i]->end_step(delta);
+            }
+        }
+
+        /**
+         * Add the world as it is now to a hash: the bird, the pipes, the
+         * ground, the pipe generator and the clock
+         */
+        void hash_state(StateHash &hash)
+        {
+            player.hash_state(hash);
+            for (size_t i = 0; i < obstacles.size(); i++)
+                obstacles[i].hash_state(hash);
+            hash.add(hash_bits(ground_x_1), hash_bits(ground_x_2));
+            hash.add(generator.get_state());
+            hash.add(last);
+            hash.add(tick, run_ticks);
+        }
+
+        uint64_t get_state_hash() const
+        {
+            return state_hash;
+        }
+
+        void snapshot(WorldSnapshot &snap)
+        {
+            snap.tick = tick;
+            snap.run_ticks = run_ticks;
+
+            snap.player_x = player.get_x();
+            snap.player_y = player.get_y();
+            snap.player_angle = player.get_angle();
+            snap.player_frame = player.get_frame();
+            snap.score = player.get_score();
+            snap.dead = player.is_dead();
+            snap.idle = player.is_idle();
+            snap.flaps = player.get_flaps();
+            snap.death_cause = player.get_death_cause();
+
+            for (int i = 0; i < NUM_OBSTACLES; i++) {
+                snap.obstacle_x[i] = static_cast<float>(obstacles[i].get_exact_x());
+                snap.obstacle_height[i] = obstacles[i].get_height();
+            }
+
+            snap.ground_x_1 = static_cast<float>(ground_x_1);
+            snap.ground_x_2 = static_cast<float>(ground_x_2);
+
+            snap.player_velocity = player.get_velocity();
+            snap.rng_state = generator.get_state();
+            snap.state_hash = state_hash;
+        }
+
+        Bird &get_player()
+        {
+            return player;
+        }
+
+    private:
+        /**
+         * The part of a step before the bird moves: the ground
+         */
+        void begin_step(int delta)
+        {
+            sp::Telemetry::count(sp::Telemetry::TICKS);
+
+            if (!player.is_dead()) {
+                ground_x_1 -= sp::muldiv<1000>(Real(Rules::scroll_speed), delta);
+                ground_x_2 -= sp::muldiv<1000>(Real(Rules::scroll_speed), delta);
+            }
+
+            if (ground_x_1 <= -GROUND_WIDTH)
+                ground_x_1 = ground_x_2 + GROUND_WIDTH;
+
+            if (ground_x_2 <= -GROUND_WIDTH)
+                ground_x_2 = ground_x_1 + GROUND_WIDTH;
+        }
+
+        /**
+         * The part of a step after the bird moves: the pipes, collisions
+         * and the clock
+         */
+        void end_step(int delta)
+        {
+            for (size_t i = 0; i < obstacles.size(); i++) {
+                Pipe &obstacle = obstacles[i];
+
+                if (player.is_idle() || player.is_dead()) {
+                    obstacle.clear_motion();
+                    continue;
+                }
+
+                // A pipe off the left edge goes round to the back, a whole
+                // lap on from where it is. Placing it behind the last pipe
+                // instead would depend on whether that one has moved yet
+                // this step.
+                obstacle.update(delta);
+                if (obstacle.get_x() + obstacle.get_width() <= 0) {
+                    obstacle.set_x(obstacle.get_exact_x() +
+                                   Rules::pipe_spacing * (int)obstacles.size());
+                    obstacle.set_height(next_height());
+                    obstacle.clear_motion();
+                    last = i;
+                }
+            }
+
+            col_bank.dispatch_collisions();
+
+            tick++;
+            if (!player.is_idle() && !player.is_dead())
+                run_ticks++;
+
+            StateHash hash;
+            hash_state(hash);
+            state_hash = hash.chain(state_hash);
+        }
+
+        BasicWorld(const BasicWorld &);
+        BasicWorld &operator=(const BasicWorld &);
+
+        int next_height()
+        {
+            return generator.range(0, SCREEN_HEIGHT - 60 - 12 * 4 - Rules::pipe_gap);
+        }
+
+        Bird player;
+        std::vector<Pipe> obstacles;
+        size_t last;
+        CollisionBank col_bank;
+
+        Random generator;
+
+        Real ground_x_1, ground_x_2;
+        unsigned long tick, run_ticks;
+        uint64_t state_hash;
+};
+
+typedef BasicWorld<float> World;
+typedef BasicWorld<sp::Fixed> FixedWorld;
+
+#endif
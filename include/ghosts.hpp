@@ -0,0 +1,410 @@
+#ifndef SP_GHOSTS_HPP
+#define SP_GHOSTS_HPP
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "SDL2/SDL.h"
+
+#include "game.hpp"
+#include "replay.hpp"
+
+
+/**
+ * Races the live bird against recorded runs, drawn as translucent birds.
+ *
+ * The corpus is a file of concatenated replays, mapped into memory rather
+ * than read. Each ghost keeps only a cursor into its replay and the few
+ * numbers the bird's flight needs, and decodes its next input as the run
+ * reaches it, so memory per ghost is fixed and the corpus itself is just
+ * file-backed pages the OS can drop. Ghosts don't need the pipes: the
+ * replay marks the tick its bird died on, and the ground stops it anyway.
+ *
+ * Ghost time is counted from each replay's first flap, in step with the
+ * live run's run_ticks, so everyone starts together whatever they did on
+ * the menu. Only replays recorded with the live game's seed and tick
+ * length are raced, since the others flew through different pipes. Each
+ * ghost flies the physics its replay was recorded with, float or fixed
+ * point, so it follows its bird's path exactly.
+ */
+class GhostRace
+{
+    public:
+        GhostRace() : data(nullptr), size(0), run_ticks(0), steps(0) {}
+
+        ~GhostRace()
+        {
+            if (data != nullptr)
+                munmap((void *)data, size);
+        }
+
+        /**
+         * Map a corpus
+         * @return false if it can't be mapped or doesn't start with a replay
+         */
+        bool open(const std::string &path)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat info;
+            if (fd == -1 || fstat(fd, &info) != 0 || info.st_size == 0) {
+                std::cerr << "Failed to open ghost corpus " << path << std::endl;
+                if (fd != -1)
+                    close(fd);
+                return false;
+            }
+
+            size = info.st_size;
+            void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED) {
+                perror("mmap");
+                size = 0;
+                return false;
+            }
+            data = (const uint8_t *)p;
+
+            ReplayCursor cursor;
+            if (!cursor.open(data, size, first)) {
+                std::cerr << path << " is not a replay corpus" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * The header of the corpus' first replay, to set the live game up
+         * to match
+         */
+        const ReplayHeader &get_first_header() const
+        {
+            return first;
+        }
+
+        /**
+         * Find the replays to race. One pass over the corpus to find where
+         * each starts; nothing from it is kept beyond that.
+         * @param max Stop after this many ghosts
+         * @return How many ghosts there are
+         */
+        size_t load(uint32_t seed, uint32_t step, size_t max)
+        {
+            ghosts.clear();
+            size_t float_count = 0, fixed_count = 0;
+
+            const uint8_t *p = data;
+            const uint8_t *end = data + size;
+            while (p < end && ghosts.size() < max) {
+                ReplayCursor cursor;
+                ReplayHeader header;
+                if (!cursor.open(p, end - p, header))
+                    break;
+
+                unsigned long tick, first_flap = 0;
+                ReplayEvent event;
+                bool flapped = false;
+                while (cursor.next(tick, event)) {
+                    if (event == REPLAY_FLAP && !flapped) {
+                        first_flap = tick;
+                        flapped = true;
+                    }
+                }
+
+                if (flapped && header.seed == seed && header.step == step) {
+                    Ghost ghost;
+                    ghost.start = p;
+                    ghost.first_flap = first_flap;
+                    ghost.fixed = header.flags & REPLAY_FIXED;
+                    ghost.slot = ghost.fixed ? fixed_count++ : float_count++;
+                    ghosts.push_back(ghost);
+                }
+
+                p = cursor.position();
+            }
+
+            ghosts.shrink_to_fit();
+            floats.resize(float_count);
+            fixeds.resize(fixed_count);
+            this->step = step;
+            rewind();
+            return ghosts.size();
+        }
+
+        /**
+         * Put every ghost back at the start of its run
+         */
+        void rewind()
+        {
+            for (Ghost &ghost : ghosts) {
+                ReplayHeader header;
+                ghost.cursor.open(ghost.start, data + size - ghost.start, header);
+
+                // Skip the menu, up to and including the first flap
+                while (ghost.cursor.next(ghost.event_tick, ghost.event) &&
+                       !(ghost.event == REPLAY_FLAP && ghost.event_tick == ghost.first_flap));
+                ghost.have_event = ghost.cursor.next(ghost.event_tick, ghost.event);
+
+                ghost.frame = 0;
+                ghost.elapsed = 0;
+                ghost.gone = false;
+            }
+
+            floats.rewind();
+            fixeds.rewind();
+            prev_y.assign(ghosts.size(), SCREEN_HEIGHT / 2 - 60);
+            prev_rotation.assign(ghosts.size(), 0);
+            steps = 0;
+            run_ticks = 0;
+        }
+
+        /**
+         * Run every ghost up to the live run's tick. Goes back to the
+         * start if the live game has been reset.
+         */
+        void advance(unsigned long run_ticks)
+        {
+            if (run_ticks < this->run_ticks)
+                rewind();
+            this->run_ticks = run_ticks;
+
+            while (steps < run_ticks)
+                step_ghosts();
+        }
+
+        /**
+         * Draw every ghost still in the race as one batch of textured quads
+         * @param x Where the birds are across the screen
+         * @param alpha How far between the last two ticks to draw them
+         * @param opacity 0 to 255
+         * @return How many ghosts were drawn
+         */
+        int draw(SDL_Renderer *renderer, SDL_Texture *texture, float x, float alpha,
+                 Uint8 opacity)
+        {
+            int tex_w, tex_h;
+            if (ghosts.empty() || SDL_QueryTexture(texture, nullptr, nullptr, &tex_w, &tex_h) != 0)
+                return 0;
+
+            vertices.clear();
+            indices.clear();
+
+            const float half_w = BIRD_WIDTH / 2.0f, half_h = BIRD_HEIGHT / 2.0f;
+            const SDL_Color color = { 255, 255, 255, opacity };
+
+            for (size_t i = 0; i < ghosts.size(); i++) {
+                const Ghost &ghost = ghosts[i];
+                if (ghost.gone)
+                    continue;
+
+                float y, rotation;
+                get_pose(ghost, y, rotation);
+                y = prev_y[i] + (y - prev_y[i]) * alpha;
+                rotation = prev_rotation[i] + (rotation - prev_rotation[i]) * alpha;
+                float radians = rotation * (float)M_PI / 180.0f;
+                float c = cosf(radians), s = sinf(radians);
+                float cx = x + half_w, cy = y + half_h;
+
+                const SDL_Rect &clip = atlas::bird[ghost.frame];
+                float u0 = (float)clip.x / tex_w, u1 = (float)(clip.x + clip.w) / tex_w;
+                float v0 = (float)clip.y / tex_h, v1 = (float)(clip.y + clip.h) / tex_h;
+
+                // Corners clockwise from the top left, turned about the
+                // center the way SDL_RenderCopyEx would
+                const float corners[4][4] = {
+                    { -half_w, -half_h, u0, v0 },
+                    {  half_w, -half_h, u1, v0 },
+                    {  half_w,  half_h, u1, v1 },
+                    { -half_w,  half_h, u0, v1 }
+                };
+
+                int base = vertices.size();
+                for (int k = 0; k < 4; k++) {
+                    SDL_Vertex v;
+                    v.position.x = cx + corners[k][0] * c - corners[k][1] * s;
+                    v.position.y = cy + corners[k][0] * s + corners[k][1] * c;
+                    v.color = color;
+                    v.tex_coord.x = corners[k][2];
+                    v.tex_coord.y = corners[k][3];
+                    vertices.push_back(v);
+                }
+
+                const int quad[6] = { 0, 1, 2, 0, 2, 3 };
+                for (int k = 0; k < 6; k++)
+                    indices.push_back(base + quad[k]);
+            }
+
+            if (vertices.empty())
+                return 0;
+
+            SDL_RenderGeometry(renderer, texture, vertices.data(), vertices.size(),
+                               indices.data(), indices.size());
+            sp::Telemetry::count(sp::Telemetry::DRAW_CALLS);
+            return vertices.size() / 4;
+        }
+
+        size_t get_count() const
+        {
+            return ghosts.size();
+        }
+
+    private:
+        struct Ghost
+        {
+            ReplayCursor cursor;
+            const uint8_t *start;
+            unsigned long first_flap;
+
+            unsigned long event_tick;
+            ReplayEvent event;
+            bool have_event;
+
+            // Whether the replay ran on fixed point physics, and where the
+            // ghost's flight is in the flock for that kind
+            bool fixed;
+            size_t slot;
+
+            int frame, elapsed;
+            bool gone;
+        };
+
+        /**
+         * The flight of every ghost that flies one kind of physics, as
+         * arrays so fly() can step them all at once
+         */
+        template <typename Real>
+        struct Flock
+        {
+            std::vector<Real> y, y_v, rotation;
+            std::vector<uint8_t> dead;
+
+            void resize(size_t n)
+            {
+                y.resize(n);
+                y_v.resize(n);
+                rotation.resize(n);
+                dead.resize(n);
+            }
+
+            void rewind()
+            {
+                std::fill(y.begin(), y.end(), Real(SCREEN_HEIGHT / 2 - 60));
+                std::fill(y_v.begin(), y_v.end(), Real(ArcadeRules::flap_speed));
+                std::fill(rotation.begin(), rotation.end(), Real(0));
+                std::fill(dead.begin(), dead.end(), 0);
+            }
+
+            void step(int delta)
+            {
+                fly<ArcadeRules>(y.data(), y_v.data(), rotation.data(), dead.data(), y.size(), delta);
+            }
+
+            void flap(size_t i)
+            {
+                if (!dead[i])
+                    y_v[i] = Real(ArcadeRules::flap_speed);
+            }
+        };
+
+        void get_pose(const Ghost &ghost, float &y, float &rotation) const
+        {
+            if (ghost.fixed) {
+                y = (float)fixeds.y[ghost.slot];
+                rotation = (float)fixeds.rotation[ghost.slot];
+            } else {
+                y = floats.y[ghost.slot];
+                rotation = floats.rotation[ghost.slot];
+            }
+        }
+
+        uint8_t &dead(const Ghost &ghost)
+        {
+            return ghost.fixed ? fixeds.dead[ghost.slot] : floats.dead[ghost.slot];
+        }
+
+        /**
+         * One tick for every ghost: this tick's inputs one ghost at a
+         * time, then the flight for each flock in one pass over its
+         * arrays. Ghosts that are gone still fly, they just aren't drawn.
+         *
+         * A death is marked on the tick the bird died on, and it died
+         * during that tick's step, so it's applied after the step.
+         */
+        void step_ghosts()
+        {
+            for (size_t i = 0; i < ghosts.size(); i++) {
+                Ghost &ghost = ghosts[i];
+                unsigned long tick = ghost.first_flap + steps;
+
+                while (!ghost.gone && ghost.have_event && ghost.event_tick <= tick) {
+                    if (ghost.event == REPLAY_DEATH && ghost.event_tick == tick)
+                        break;
+
+                    switch (ghost.event) {
+                        case REPLAY_FLAP:
+                            if (ghost.fixed)
+                                fixeds.flap(ghost.slot);
+                            else
+                                floats.flap(ghost.slot);
+                            break;
+                        case REPLAY_DEATH:
+                            dead(ghost) = 1;
+                            break;
+                        case REPLAY_HASH:
+                            break;
+                        default:
+                            // A reset or the end: this run is over
+                            ghost.gone = true;
+                            break;
+                    }
+                    ghost.have_event = ghost.cursor.next(ghost.event_tick, ghost.event);
+                }
+
+                get_pose(ghost, prev_y[i], prev_rotation[i]);
+            }
+
+            floats.step(step);
+            fixeds.step(step);
+
+            for (size_t i = 0; i < ghosts.size(); i++) {
+                Ghost &ghost = ghosts[i];
+                flap_wings(ghost.frame, ghost.elapsed, dead(ghost), step);
+
+                if (!ghost.gone && ghost.have_event && ghost.event == REPLAY_DEATH &&
+                    ghost.event_tick == ghost.first_flap + steps) {
+                    dead(ghost) = 1;
+                    ghost.have_event = ghost.cursor.next(ghost.event_tick, ghost.event);
+                }
+            }
+            steps++;
+        }
+
+        const uint8_t *data;
+        size_t size;
+        ReplayHeader first;
+
+        std::vector<Ghost> ghosts;
+        int step;
+        unsigned long run_ticks;
+
+        // The ghosts from float and from fixed point replays, flown the
+        // way they were recorded. All of them are steps ticks into their run.
+        Flock<float> floats;
+        Flock<sp::Fixed> fixeds;
+        unsigned long steps;
+
+        // Each ghost's pose before the last step, to draw in between
+        std::vector<float> prev_y, prev_rotation;
+
+        std::vector<SDL_Vertex> vertices;
+        std::vector<int> indices;
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef SP_LOCKFREE_HPP
+#define SP_LOCKFREE_HPP
+
+#include <atomic>
+#include <cstddef>
+
+
+namespace sp {
+
+    /**
+     * Single producer, single consumer triple buffer. The producer always
+     * has a slot to write into and the consumer always has a slot to read
+     * from; publishing and picking up the latest value are one atomic
+     * exchange each, so neither side ever waits on the other.
+     */
+    template <typename T>
+    class TripleBuffer
+    {
+        public:
+            TripleBuffer() : middle(1), back(0), front(2) {}
+
+            /**
+             * The slot the producer fills before calling publish
+             */
+            T &write_buffer()
+            {
+                return buffers[back];
+            }
+
+            /**
+             * Hand the write buffer over to the consumer
+             */
+            void publish()
+            {
+                back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+            }
+
+            /**
+             * Pick up the most recently published value, if there is one
+             * @return true if read_buffer changed
+             */
+            bool update()
+            {
+                if (!(middle.load(std::memory_order_relaxed) & FRESH))
+                    return false;
+
+                front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+                return true;
+            }
+
+            /**
+             * The slot the consumer reads from, valid until the next update
+             */
+            const T &read_buffer() const
+            {
+                return buffers[front];
+            }
+
+        private:
+            enum { INDEX = 3, FRESH = 4 };
+
+            T buffers[3];
+            std::atomic<unsigned> middle;
+            unsigned back, front;
+    };
+
+
+    /**
+     * Bounded single producer, single consumer queue. Both push and pop
+     * finish in a fixed number of steps; push fails instead of waiting
+     * when the queue is full.
+     * N must be a power of two.
+     */
+    template <typename T, size_t N>
+    class SpscQueue
+    {
+        public:
+            SpscQueue() : head(0), tail(0) {}
+
+            bool push(const T &item)
+            {
+                size_t t = tail.load(std::memory_order_relaxed);
+                if (t - head.load(std::memory_order_acquire) == N)
+                    return false;
+
+                items[t & (N - 1)] = item;
+                tail.store(t + 1, std::memory_order_release);
+                return true;
+            }
+
+            bool pop(T &item)
+            {
+                size_t h = head.load(std::memory_order_relaxed);
+                if (h == tail.load(std::memory_order_acquire))
+                    return false;
+
+                item = items[h & (N - 1)];
+                head.store(h + 1, std::memory_order_release);
+                return true;
+            }
+
+            /**
+             * Only meaningful on the consumer side
+             */
+            bool empty() const
+            {
+                return head.load(std::memory_order_relaxed) ==
+                       tail.load(std::memory_order_acquire);
+            }
+
+        private:
+            static_assert((N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+
+            T items[N];
+            alignas(64) std::atomic<size_t> head;
+            alignas(64) std::atomic<size_t> tail;
+    };
+
+}
+
+#endif
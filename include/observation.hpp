@@ -0,0 +1,149 @@
+#ifndef SP_OBSERVATION_HPP
+#define SP_OBSERVATION_HPP
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "game.hpp"
+
+
+/**
+ * Rasterizes world snapshots straight into small grayscale frames for
+ * training, without going through SDL. The bird, pipes and ground are
+ * drawn as flat boxes at fixed gray levels; there is no texture sampling,
+ * so a frame costs a few span fills.
+ *
+ * Observations are stacks of the last few frames laid out
+ * [stack][height][width]. Rather than shifting the stack along every tick,
+ * the frame for tick t is drawn into slot t % stack, so nothing is ever
+ * copied; to read a stack oldest first, start at slot (t + 1) % stack.
+ * The shared memory step server (cf --serve-shm --shm-pixels) keeps one
+ * observation per session back to back, which is the usual
+ * [n][stack][height][width] uint8 tensor.
+ */
+class ObservationRenderer
+{
+    public:
+        enum Shade {
+            SKY = 0,
+            GROUND = 96,
+            PIPE = 160,
+            BIRD = 255
+        };
+
+        ObservationRenderer(int width = 84, int height = 84, int stack = 4)
+            : width(width), height(height), stack(stack) {}
+
+        size_t frame_size() const
+        {
+            return (size_t)width * height;
+        }
+
+        size_t observation_size() const
+        {
+            return frame_size() * stack;
+        }
+
+        /**
+         * Draw one snapshot into a single frame
+         * @param snap The world to draw
+         * @param frame width * height bytes to draw into
+         */
+        void render(const WorldSnapshot &snap, uint8_t *frame) const
+        {
+            fill(frame, frame_size(), SKY);
+
+            fill_rect(frame, 0, SCREEN_HEIGHT - 60, SCREEN_WIDTH, SCREEN_HEIGHT, GROUND);
+
+            for (int i = 0; i < NUM_OBSTACLES; i++) {
+                int x = (int)snap.obstacle_x[i];
+                int top, bottom;
+                pipe_gap(snap.obstacle_height[i], top, bottom);
+
+                fill_rect(frame, x, 0, x + 26 * 2, top, PIPE);
+                fill_rect(frame, x, bottom, x + 26 * 2, SCREEN_HEIGHT - 60, PIPE);
+            }
+
+            int x = (int)snap.player_x;
+            int y = (int)snap.player_y;
+            fill_rect(frame, x, y, x + 38, y + 24, BIRD);
+        }
+
+        /**
+         * Draw a snapshot into its slot of a stacked observation
+         * @param snap The world to draw
+         * @param observation observation_size() bytes
+         */
+        void push(const WorldSnapshot &snap, uint8_t *observation) const
+        {
+            render(snap, observation + frame_size() * (snap.tick % stack));
+        }
+
+        /**
+         * Start a stacked observation over: every slot gets the snapshot,
+         * so a new run doesn't see frames from the last one
+         * @param snap The world to draw
+         * @param observation observation_size() bytes
+         */
+        void reset(const WorldSnapshot &snap, uint8_t *observation) const
+        {
+            render(snap, observation);
+            for (int i = 1; i < stack; i++)
+                std::memcpy(observation + frame_size() * i, observation, frame_size());
+        }
+
+        int get_width() const
+        {
+            return width;
+        }
+
+        int get_height() const
+        {
+            return height;
+        }
+
+        int get_stack() const
+        {
+            return stack;
+        }
+
+    private:
+        /**
+         * Fill a rect given in screen coordinates, scaled down to the
+         * frame and clipped to it
+         */
+        void fill_rect(uint8_t *frame, int x0, int y0, int x1, int y1,
+                       uint8_t shade) const
+        {
+            int c0 = std::max(0, x0 * width / SCREEN_WIDTH);
+            int c1 = std::min(width, (x1 * width + SCREEN_WIDTH - 1) / SCREEN_WIDTH);
+            int r0 = std::max(0, y0 * height / SCREEN_HEIGHT);
+            int r1 = std::min(height, (y1 * height + SCREEN_HEIGHT - 1) / SCREEN_HEIGHT);
+
+            if (c0 >= c1)
+                return;
+
+            for (int r = r0; r < r1; r++)
+                fill(frame + (size_t)r * width + c0, c1 - c0, shade);
+        }
+
+        static void fill(uint8_t *p, size_t n, uint8_t shade)
+        {
+#ifdef __SSE2__
+            __m128i v = _mm_set1_epi8((char)shade);
+            for (; n >= 16; n -= 16, p += 16)
+                _mm_storeu_si128((__m128i *)p, v);
+#endif
+            for (; n > 0; n--)
+                *p++ = shade;
+        }
+
+        int width, height, stack;
+};
+
+#endif
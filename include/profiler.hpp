@@ -0,0 +1,128 @@
+#ifndef SP_PROFILER_HPP
+#define SP_PROFILER_HPP
+
+#include <iostream>
+#include <ctime>
+#include <algorithm>
+
+
+namespace sp {
+
+    /**
+     * Per-frame counters that get summed up and reported once a second,
+     * either as a per-frame average or as a total for the second.
+     * Reporting is on by default in debug builds and can be switched on
+     * at runtime with set_enabled.
+     */
+    class Profiler
+    {
+        public:
+            enum Counter {
+                DRAWN,
+                CULLED,
+                TICKS,
+                WAKEUPS,
+                NUM_COUNTERS
+            };
+
+            Profiler()
+            {
+#ifdef DEBUG
+                enabled = true;
+#else
+                enabled = false;
+#endif
+                frames = 0;
+                last_report = 0;
+                last_cpu = std::clock();
+                reset();
+            }
+
+            void set_enabled(bool enabled)
+            {
+                this->enabled = enabled;
+            }
+
+            /**
+             * Add n to a counter for the current frame
+             * @param counter The counter to bump
+             * @param n The amount to add
+             */
+            void count(Counter counter, unsigned long n = 1)
+            {
+                totals[counter] += n;
+            }
+
+            /**
+             * Mark the end of a rendered frame
+             */
+            void end_frame()
+            {
+                frames++;
+            }
+
+            /**
+             * Once a second (in ms ticks) write the per-frame averages and
+             * per-second totals out to stderr, along with how much CPU time
+             * the process used over that second.
+             * @param now The current tick count in milliseconds
+             */
+            void report(unsigned long now)
+            {
+                if (now - last_report < 1000)
+                    return;
+
+                std::clock_t cpu = std::clock();
+
+                if (enabled) {
+                    double seconds = (now - last_report) / 1000.0;
+                    double cpu_used = (double)(cpu - last_cpu) / CLOCKS_PER_SEC;
+
+                    std::cerr << "[profile] fps " << frames;
+                    for (int i = 0; i < NUM_COUNTERS; i++)
+                        std::cerr << " " << counter_name((Counter)i) << " "
+                                  << (per_frame((Counter)i) ? totals[i] / std::max(frames, 1ul)
+                                                            : totals[i]);
+                    std::cerr << " cpu " << (int)(100 * cpu_used / seconds) << "%"
+                              << std::endl;
+                }
+
+                frames = 0;
+                last_report = now;
+                last_cpu = cpu;
+                reset();
+            }
+
+        private:
+            static const char *counter_name(Counter counter)
+            {
+                static const char *names[NUM_COUNTERS] = {
+                    "drawn",
+                    "culled",
+                    "ticks",
+                    "wakeups"
+                };
+                return names[counter];
+            }
+
+            static bool per_frame(Counter counter)
+            {
+                return counter != TICKS && counter != WAKEUPS;
+            }
+
+            void reset()
+            {
+                for (int i = 0; i < NUM_COUNTERS; i++)
+                    totals[i] = 0;
+            }
+
+            bool enabled;
+            unsigned long frames;
+            unsigned long last_report;
+            std::clock_t last_cpu;
+            unsigned long totals[NUM_COUNTERS];
+    };
+
+}
+
+#endif
@@ -0,0 +1,347 @@
+#ifndef SP_REPLAY_HPP
+#define SP_REPLAY_HPP
+
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include "game.hpp"
+
+
+/*
+ * A replay is everything needed to re-run a session tick for tick: the
+ * seed, the tick length and the inputs with the tick they were applied on.
+ *
+ * Layout, all little endian:
+ *   "CFRP"  magic
+ *   u32     version
+ *   u32     seed
+ *   u32     tick length in ms
+ *   u32     flags (REPLAY_FIXED)
+ *   then one LEB128 varint per event: (ticks since last event << 3) | type
+ *   (<< 2 in version 1 replays, which have no hashes)
+ *
+ * Events on tick t are applied before the world steps for the t'th time.
+ * REPLAY_DEATH isn't an input but a marker for the step the bird died on,
+ * so something replaying just the bird (a ghost) knows when it hit a pipe.
+ * REPLAY_HASH is followed by a u64, the world's state hash after stepping
+ * that tick, every REPLAY_HASH_INTERVAL ticks and on the step the bird
+ * died, so a replay that plays back differently can be caught in the act.
+ *
+ * The last event is always REPLAY_END, so replays can be concatenated into
+ * one corpus file and still be read back one by one.
+ */
+
+#define REPLAY_VERSION 2
+#define REPLAY_HEADER_SIZE 20
+#define REPLAY_FIXED 1
+#define REPLAY_HASH_INTERVAL 32
+
+enum ReplayEvent {
+    REPLAY_FLAP = INPUT_FLAP,
+    REPLAY_RESET = INPUT_RESET,
+    REPLAY_DEATH = 2,
+    REPLAY_END = 3,
+    REPLAY_HASH = 4
+};
+
+
+struct ReplayHeader
+{
+    uint32_t version;
+    uint32_t seed;
+    uint32_t step;
+    uint32_t flags;
+};
+
+
+/**
+ * Walks the event stream of one replay held in memory. Nothing is copied,
+ * so it works just as well over a memory-mapped corpus.
+ */
+class ReplayCursor
+{
+    public:
+        ReplayCursor() : pos(nullptr), end(nullptr), tick(0), hash(0), type_bits(3),
+                         done(true) {}
+
+        /**
+         * Start reading a replay
+         * @param data Points at the replay's header
+         * @param size Bytes available from data onwards
+         * @param header Receives the header
+         * @return false if there's no valid replay at data
+         */
+        bool open(const uint8_t *data, size_t size, ReplayHeader &header)
+        {
+            done = true;
+
+            if (size < REPLAY_HEADER_SIZE || data[0] != 'C' || data[1] != 'F' ||
+                data[2] != 'R' || data[3] != 'P')
+                return false;
+
+            header.version = read_u32(data + 4);
+            header.seed = read_u32(data + 8);
+            header.step = read_u32(data + 12);
+            header.flags = read_u32(data + 16);
+
+            if (header.version < 1 || header.version > REPLAY_VERSION || header.step == 0)
+                return false;
+
+            pos = data + REPLAY_HEADER_SIZE;
+            end = data + size;
+            tick = 0;
+            type_bits = header.version == 1 ? 2 : 3;
+            done = false;
+            return true;
+        }
+
+        /**
+         * Decode the next event
+         * @param event_tick Receives the tick the event happens on
+         * @param event Receives the event type
+         * @return false once the stream is over or broken
+         */
+        bool next(unsigned long &event_tick, ReplayEvent &event)
+        {
+            if (done)
+                return false;
+
+            uint64_t code = 0;
+            int shift = 0;
+            for (;;) {
+                if (pos == end || shift > 63) {
+                    done = true;
+                    return false;
+                }
+                uint8_t byte = *pos++;
+                code |= (uint64_t)(byte & 0x7f) << shift;
+                shift += 7;
+                if (!(byte & 0x80))
+                    break;
+            }
+
+            tick += code >> type_bits;
+            event_tick = tick;
+            event = (ReplayEvent)(code & ((1 << type_bits) - 1));
+
+            if (event == REPLAY_HASH) {
+                if (end - pos < 8) {
+                    done = true;
+                    return false;
+                }
+                hash = read_u32(pos) | (uint64_t)read_u32(pos + 4) << 32;
+                pos += 8;
+            }
+
+            if (event == REPLAY_END || event > REPLAY_HASH)
+                done = true;
+
+            return event <= REPLAY_HASH;
+        }
+
+        /**
+         * The state hash of the REPLAY_HASH event next() last returned
+         */
+        uint64_t get_hash() const
+        {
+            return hash;
+        }
+
+        bool finished() const
+        {
+            return done;
+        }
+
+        /**
+         * Where the next replay starts, once this one is finished
+         */
+        const uint8_t *position() const
+        {
+            return pos;
+        }
+
+    private:
+        static uint32_t read_u32(const uint8_t *p)
+        {
+            return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        }
+
+        const uint8_t *pos, *end;
+        unsigned long tick;
+        uint64_t hash;
+        int type_bits;
+        bool done;
+};
+
+
+/**
+ * Loads a whole replay file and hands out its inputs tick by tick
+ */
+class ReplayReader
+{
+    public:
+        bool open(const std::string &path)
+        {
+            std::ifstream in(path.c_str(), std::ios::binary);
+            if (in.fail())
+                return false;
+
+            data.assign(std::istreambuf_iterator<char>(in),
+                        std::istreambuf_iterator<char>());
+
+            if (!cursor.open(data.data(), data.size(), header))
+                return false;
+
+            have_event = cursor.next(event_tick, event);
+            return true;
+        }
+
+        const ReplayHeader &get_header() const
+        {
+            return header;
+        }
+
+        /**
+         * Pop the next input due on this tick
+         * @param tick The tick about to be stepped
+         * @param input Receives the input
+         * @return false if there's nothing (more) for this tick
+         */
+        bool poll(unsigned long tick, InputType &input)
+        {
+            while (have_event && (event == REPLAY_DEATH || event == REPLAY_HASH))
+                have_event = cursor.next(event_tick, event);
+
+            if (!have_event || event == REPLAY_END || event_tick != tick)
+                return false;
+
+            input = (InputType)event;
+            have_event = cursor.next(event_tick, event);
+            return true;
+        }
+
+        /**
+         * Whether the recording is over at this tick
+         */
+        bool finished(unsigned long tick) const
+        {
+            return !have_event || (event == REPLAY_END && tick >= event_tick);
+        }
+
+    private:
+        std::vector<uint8_t> data;
+        ReplayCursor cursor;
+        ReplayHeader header;
+        bool have_event;
+        unsigned long event_tick;
+        ReplayEvent event;
+};
+
+
+/**
+ * Records inputs as they are applied and writes them out as a replay
+ */
+class ReplayWriter
+{
+    public:
+        ReplayWriter() : last_tick(0) {}
+
+        ~ReplayWriter()
+        {
+            if (out.is_open())
+                finish(last_tick);
+        }
+
+        /**
+         * @param append Add to the end of the file, to build up a corpus
+         */
+        bool open(const std::string &path, uint32_t seed, uint32_t step,
+                  uint32_t flags, bool append = false)
+        {
+            out.open(path.c_str(), std::ios::binary |
+                     (append ? std::ios::app : std::ios::trunc));
+            if (out.fail())
+                return false;
+
+            out.write("CFRP", 4);
+            write_u32(REPLAY_VERSION);
+            write_u32(seed);
+            write_u32(step);
+            write_u32(flags);
+
+            last_tick = 0;
+            return !out.fail();
+        }
+
+        bool is_open() const
+        {
+            return out.is_open();
+        }
+
+        void record(unsigned long tick, InputType input)
+        {
+            write_event(tick, (ReplayEvent)input);
+        }
+
+        /**
+         * Note that the bird died while stepping this tick
+         */
+        void record_death(unsigned long tick)
+        {
+            write_event(tick, REPLAY_DEATH);
+        }
+
+        /**
+         * Note the world's state hash after stepping this tick
+         */
+        void record_hash(unsigned long tick, uint64_t hash)
+        {
+            write_event(tick, REPLAY_HASH);
+            write_u32((uint32_t)hash);
+            write_u32((uint32_t)(hash >> 32));
+        }
+
+        /**
+         * End the replay at the given tick and close the file
+         */
+        void finish(unsigned long tick)
+        {
+            write_event(std::max(tick, last_tick), REPLAY_END);
+            out.close();
+        }
+
+    private:
+        void write_event(unsigned long tick, ReplayEvent event)
+        {
+            uint64_t code = ((uint64_t)(tick - last_tick) << 3) | event;
+            last_tick = tick;
+
+            do {
+                uint8_t byte = code & 0x7f;
+                code >>= 7;
+                if (code)
+                    byte |= 0x80;
+                out.put((char)byte);
+            } while (code);
+        }
+
+        void write_u32(uint32_t value)
+        {
+            char bytes[4] = {
+                (char)(value & 0xff),
+                (char)((value >> 8) & 0xff),
+                (char)((value >> 16) & 0xff),
+                (char)((value >> 24) & 0xff)
+            };
+            out.write(bytes, 4);
+        }
+
+        std::ofstream out;
+        unsigned long last_tick;
+};
+
+#endif
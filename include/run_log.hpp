@@ -0,0 +1,311 @@
+#ifndef SP_RUN_LOG_HPP
+#define SP_RUN_LOG_HPP
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <stdint.h>
+
+#include "game.hpp"
+
+
+/*
+ * An append-only log of finished runs, one row per run, for sweeps that
+ * play far more games than anyone could keep replays of.
+ *
+ * Rows are stored by column in fixed size blocks, so the file is an array
+ * of identical structs that numpy can map as is. Layout, native (little)
+ * endian:
+ *   RunLogHeader, 64 bytes
+ *   RunBlock...   each RUN_LOG_BLOCK_ROWS rows of every column, of which
+ *                 the first `rows` are used
+ *
+ * Blocks are filled by a RunLogBuffer per thread and written by the log's
+ * own writer thread, in the order they fill up, so rows from different
+ * threads interleave by block. Sort by seed if order matters.
+ *
+ * Loading it:
+ *
+ *   import numpy as np
+ *   R = 4096
+ *   block = np.dtype([('rows', '<u4'), ('reserved', '<u4', 15),
+ *                     ('seed', '<u4', R), ('score', '<u4', R),
+ *                     ('death_tick', '<u4', R), ('flaps', '<u4', R),
+ *                     ('state_hash', '<u8', R), ('death_cause', 'u1', R)])
+ *   b = np.memmap('runs.bin', dtype=block, mode='r', offset=64)
+ *   used = np.arange(R) < b['rows'][:, None]
+ *   runs = {c: b[c][used] for c in ('seed', 'score', 'death_tick', 'flaps',
+ *                                   'state_hash', 'death_cause')}
+ *
+ * and pandas.DataFrame(runs) from there. death_cause is a DeathCause.
+ * state_hash is the world's state hash where the run ended, so two sweeps
+ * over the same seeds on different machines or builds can be compared run
+ * by run with cf-desync.
+ */
+
+#define RUN_LOG_VERSION 2
+#define RUN_LOG_COLUMNS 6
+#define RUN_LOG_BLOCK_ROWS 4096
+
+
+struct RunLogHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t block_rows;
+    uint32_t block_size;
+    uint32_t columns;
+    uint8_t reserved[40];
+};
+
+struct RunBlock
+{
+    uint32_t rows;
+    uint32_t reserved[15];
+
+    uint32_t seed[RUN_LOG_BLOCK_ROWS];
+    uint32_t score[RUN_LOG_BLOCK_ROWS];
+    // Ticks from the first flap to death (or to the end of the run)
+    uint32_t death_tick[RUN_LOG_BLOCK_ROWS];
+    uint32_t flaps[RUN_LOG_BLOCK_ROWS];
+    uint64_t state_hash[RUN_LOG_BLOCK_ROWS];
+    uint8_t death_cause[RUN_LOG_BLOCK_ROWS];
+};
+
+static_assert(sizeof(RunLogHeader) == 64, "RunLogHeader must be 64 bytes");
+static_assert(sizeof(RunBlock) % 64 == 0, "RunBlock must be a whole number of cache lines");
+
+
+/**
+ * One finished run
+ */
+struct RunRecord
+{
+    uint32_t seed;
+    uint32_t score;
+    uint32_t death_tick;
+    uint32_t flaps;
+    uint64_t state_hash;
+    DeathCause death_cause;
+
+    RunRecord(uint32_t seed, const WorldSnapshot &snap)
+        : seed(seed), score(snap.score), death_tick(snap.run_ticks),
+          flaps(snap.flaps), state_hash(snap.state_hash),
+          death_cause(snap.death_cause) {}
+};
+
+
+/**
+ * The file and the thread that writes it. Blocks cycle through a fixed
+ * pool: buffers take empty ones and hand back full ones, and the writer
+ * writes each out, clears it and puts it back. If the disk falls a whole
+ * pool behind, buffers wait for it rather than drop runs.
+ */
+class RunLog
+{
+    public:
+        /**
+         * @param pool How many blocks to cycle through; at least two per
+         *        thread that logs keeps everyone busy
+         */
+        RunLog(size_t pool = 8) : rows(0), stopping(false)
+        {
+            for (size_t i = 0; i < pool; i++) {
+                RunBlock *block = new RunBlock;
+                memset(block, 0, sizeof(RunBlock));
+                free_blocks.push_back(block);
+            }
+        }
+
+        ~RunLog()
+        {
+            close();
+            for (RunBlock *block : free_blocks)
+                delete block;
+        }
+
+        /**
+         * Open a log to add to, starting it if it's new
+         * @return false if it can't be written or is some other kind of file
+         */
+        bool open(const std::string &path)
+        {
+            RunLogHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, "CFRUNLOG", 8);
+            header.version = RUN_LOG_VERSION;
+            header.block_rows = RUN_LOG_BLOCK_ROWS;
+            header.block_size = sizeof(RunBlock);
+            header.columns = RUN_LOG_COLUMNS;
+
+            std::ifstream in(path.c_str(), std::ios::binary);
+            RunLogHeader existing;
+            if (in.read((char *)&existing, sizeof(existing))) {
+                if (memcmp(&existing, &header, sizeof(header)) != 0) {
+                    std::cerr << path << " is not a run log this build can add to" << std::endl;
+                    return false;
+                }
+                out.open(path.c_str(), std::ios::binary | std::ios::app);
+            } else {
+                out.open(path.c_str(), std::ios::binary | std::ios::trunc);
+                out.write((const char *)&header, sizeof(header));
+            }
+
+            if (out.fail()) {
+                std::cerr << "Failed to open " << path << std::endl;
+                return false;
+            }
+
+            writer = std::thread(&RunLog::write, this);
+            return true;
+        }
+
+        /**
+         * Wait for an empty block to fill
+         */
+        RunBlock *acquire()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return !free_blocks.empty(); });
+            RunBlock *block = free_blocks.back();
+            free_blocks.pop_back();
+            return block;
+        }
+
+        /**
+         * Queue a block to be written, full or not
+         */
+        void submit(RunBlock *block)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                full_blocks.push_back(block);
+            }
+            changed.notify_all();
+        }
+
+        /**
+         * Write everything submitted so far and close the file
+         */
+        void close()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            changed.notify_all();
+
+            if (writer.joinable())
+                writer.join();
+            if (out.is_open())
+                out.close();
+        }
+
+        /**
+         * How many runs have been written
+         */
+        unsigned long get_rows() const
+        {
+            return rows;
+        }
+
+    private:
+        RunLog(const RunLog &);
+        RunLog &operator=(const RunLog &);
+
+        void write()
+        {
+            for (;;) {
+                RunBlock *block;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait(lock, [this] { return stopping || !full_blocks.empty(); });
+                    if (full_blocks.empty())
+                        return;
+                    block = full_blocks.front();
+                    full_blocks.pop_front();
+                }
+
+                if (block->rows > 0) {
+                    out.write((const char *)block, sizeof(RunBlock));
+                    rows += block->rows;
+                }
+                memset(block, 0, sizeof(RunBlock));
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    free_blocks.push_back(block);
+                }
+                changed.notify_all();
+            }
+        }
+
+        std::ofstream out;
+        std::atomic<unsigned long> rows;
+
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::vector<RunBlock *> free_blocks;
+        std::deque<RunBlock *> full_blocks;
+        bool stopping;
+        std::thread writer;
+};
+
+
+/**
+ * Where one thread puts its runs. Only touches the log once a block is
+ * full, so adding a run is a handful of stores.
+ */
+class RunLogBuffer
+{
+    public:
+        RunLogBuffer(RunLog &log) : log(log), block(nullptr) {}
+
+        ~RunLogBuffer()
+        {
+            flush();
+        }
+
+        void add(const RunRecord &run)
+        {
+            if (block == nullptr)
+                block = log.acquire();
+
+            uint32_t i = block->rows++;
+            block->seed[i] = run.seed;
+            block->score[i] = run.score;
+            block->death_tick[i] = run.death_tick;
+            block->flaps[i] = run.flaps;
+            block->state_hash[i] = run.state_hash;
+            block->death_cause[i] = run.death_cause;
+
+            if (block->rows == RUN_LOG_BLOCK_ROWS)
+                flush();
+        }
+
+        /**
+         * Hand over the block being filled, however full it is
+         */
+        void flush()
+        {
+            if (block != nullptr)
+                log.submit(block);
+            block = nullptr;
+        }
+
+    private:
+        RunLogBuffer(const RunLogBuffer &);
+        RunLogBuffer &operator=(const RunLogBuffer &);
+
+        RunLog &log;
+        RunBlock *block;
+};
+
+#endif
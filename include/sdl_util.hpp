@@ -1,5 +1,12 @@
+#ifndef SP_SDL_UTIL_HPP
+#define SP_SDL_UTIL_HPP
+
+#include <algorithm>
+
 #include "SDL2/SDL.h"
 
+#include "telemetry.hpp"
+
 
 namespace sp {
 
@@ -13,9 +20,10 @@ namespace sp {
      *       default of nullptr draws the entire texture
      */
     void render_texture(SDL_Renderer *ren, SDL_Texture *tex, SDL_Rect dst,
-                        SDL_Rect *clip = nullptr, const double angle=0)
+                        const SDL_Rect *clip = nullptr, const double angle=0)
     {
         SDL_RenderCopyEx(ren, tex, clip, &dst, angle, nullptr, SDL_FLIP_NONE);
+        Telemetry::count(Telemetry::DRAW_CALLS);
     }
 
     /**
@@ -31,7 +39,7 @@ namespace sp {
       *        default of nullptr draws the entire texture
       */
     void render_texture(SDL_Renderer *ren, SDL_Texture *tex, int x, int y,
-                        SDL_Rect *clip = nullptr, const double angle=0)
+                        const SDL_Rect *clip = nullptr, const double angle=0)
     {
         SDL_Rect dst;
         dst.x = x;
@@ -46,4 +54,23 @@ namespace sp {
         render_texture(ren, tex, dst, clip);
     }
 
+    /**
+     * Where a w x h image goes to fill as much of the output as it can at a
+     * whole number scale, centred with black bars on whatever is left over.
+     * Never less than 1x, so an output smaller than the image crops it.
+     * @param out_w The output's width in pixels
+     * @param out_h The output's height in pixels
+     * @param w The image's width
+     * @param h The image's height
+     */
+    inline SDL_Rect integer_fit(int out_w, int out_h, int w, int h)
+    {
+        int scale = std::max(1, std::min(out_w / w, out_h / h));
+        SDL_Rect dst = { (out_w - w * scale) / 2, (out_h - h * scale) / 2,
+                         w * scale, h * scale };
+        return dst;
+    }
+
 }
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef SP_SHM_RING_HPP
+#define SP_SHM_RING_HPP
+
+#include <atomic>
+#include <thread>
+#include <ctime>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+namespace sp {
+
+    /**
+     * Sleep while *word still holds expected. Works across processes, so
+     * the word can live in shared memory.
+     * @param timeout_ms Give up after this long; negative waits forever
+     */
+    inline void futex_wait(std::atomic<uint32_t> *word, uint32_t expected, int timeout_ms = -1)
+    {
+        timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+        syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, expected,
+                timeout_ms < 0 ? nullptr : &timeout, nullptr, 0);
+    }
+
+    inline void futex_wake(std::atomic<uint32_t> *word)
+    {
+        syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+    }
+
+    inline void cpu_relax()
+    {
+#if defined(__SSE2__)
+        _mm_pause();
+#endif
+    }
+
+
+    /**
+     * How long to poll for a handover before sleeping on it. On a single
+     * CPU the other side can't run while we spin, so don't.
+     */
+    inline int default_spins()
+    {
+        static const int spins = std::thread::hardware_concurrency() > 1 ? 4096 : 0;
+        return spins;
+    }
+
+
+    /**
+     * Single producer, single consumer ring meant to be placed in memory
+     * shared between two processes: it holds no pointers, only fixed size
+     * atomics, and is set up with init() instead of a constructor. T must
+     * be trivially copyable.
+     *
+     * The consumer spins for a while when the ring is empty and only then
+     * goes to sleep on a futex, so a busy pair of processes never makes a
+     * syscall to hand items over, and an idle one doesn't burn a core.
+     */
+    template <typename T, size_t N>
+    class ShmRing
+    {
+        public:
+            void init()
+            {
+                head.store(0, std::memory_order_relaxed);
+                tail.store(0, std::memory_order_relaxed);
+                waiting.store(0, std::memory_order_relaxed);
+            }
+
+            bool push(const T &item)
+            {
+                uint32_t t = tail.load(std::memory_order_relaxed);
+                if (t - head.load(std::memory_order_acquire) == N)
+                    return false;
+
+                items[t & (N - 1)] = item;
+                tail.store(t + 1, std::memory_order_seq_cst);
+
+                // Pairs with the consumer raising waiting before it checks
+                // tail one last time; one of the two sees the other's store
+                if (waiting.load(std::memory_order_seq_cst))
+                    futex_wake(&tail);
+                return true;
+            }
+
+            bool pop(T &item)
+            {
+                uint32_t h = head.load(std::memory_order_relaxed);
+                if (h == tail.load(std::memory_order_acquire))
+                    return false;
+
+                item = items[h & (N - 1)];
+                head.store(h + 1, std::memory_order_release);
+                return true;
+            }
+
+            /**
+             * pop(), waiting for an item if there isn't one
+             * @param spins How many times to poll before sleeping, or -1
+             *        for default_spins()
+             * @param timeout_ms Give up after sleeping this long
+             * @return false if it woke up without an item (a timeout, a
+             *         signal), so callers should loop
+             */
+            bool pop_wait(T &item, int spins = -1, int timeout_ms = -1)
+            {
+                if (spins < 0)
+                    spins = default_spins();
+
+                for (int i = 0; i < spins; i++) {
+                    if (pop(item))
+                        return true;
+                    cpu_relax();
+                }
+
+                uint32_t seen = head.load(std::memory_order_relaxed);
+                waiting.store(1, std::memory_order_seq_cst);
+                if (tail.load(std::memory_order_seq_cst) == seen)
+                    futex_wait(&tail, seen, timeout_ms);
+                waiting.store(0, std::memory_order_relaxed);
+
+                return pop(item);
+            }
+
+        private:
+            static_assert((N & (N - 1)) == 0, "ShmRing size must be a power of two");
+            static_assert(sizeof(std::atomic<uint32_t>) == 4, "ShmRing needs plain 32 bit atomics");
+
+            alignas(64) std::atomic<uint32_t> head;
+            alignas(64) std::atomic<uint32_t> tail;
+            std::atomic<uint32_t> waiting;
+            alignas(64) T items[N];
+    };
+
+}
+
+#endif
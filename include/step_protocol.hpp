@@ -0,0 +1,78 @@
+#ifndef SP_STEP_PROTOCOL_HPP
+#define SP_STEP_PROTOCOL_HPP
+
+#include <stdint.h>
+
+
+/*
+ * Wire format of the step server (cf --serve). Clients connect to a Unix
+ * domain socket and write fixed size StepRequests; every request gets
+ * exactly one StepReply back, and an observe reply is followed by a
+ * StepObservation. Both ends are on the same machine, so everything is in
+ * host byte order.
+ *
+ * A connection can own any number of sessions, and may pipeline as many
+ * requests as it likes. Requests for one session are handled in the order
+ * they were sent; replies for different sessions can come back in any
+ * order, so match them up by session id.
+ *
+ * Sessions start with the bird idle on the menu, like the game does; the
+ * first flap starts the run.
+ */
+
+#define STEP_PROTOCOL_VERSION 1
+#define STEP_OBSTACLES 4
+
+enum StepOp {
+    /* Create a session; arg is its seed and version must be
+     * STEP_PROTOCOL_VERSION. The reply carries the new id. */
+    STEP_OPEN = 1,
+    /* Start a new run in the session; arg is the seed */
+    STEP_RESET = 2,
+    /* Advance the session one tick; action 1 flaps first */
+    STEP_STEP = 3,
+    /* Reply with a StepObservation of the session */
+    STEP_OBSERVE = 4,
+    STEP_CLOSE = 5
+};
+
+enum StepStatus {
+    STEP_OK = 0,
+    STEP_BAD_OP = 1,
+    STEP_BAD_SESSION = 2,
+    STEP_FULL = 3
+};
+
+struct StepRequest
+{
+    uint8_t op;
+    uint8_t action;
+    uint16_t version;
+    uint32_t session;
+    uint32_t arg;
+};
+
+struct StepReply
+{
+    uint8_t op;
+    uint8_t status;
+    uint8_t dead;
+    uint8_t reserved;
+    uint32_t session;
+    uint32_t tick;
+    uint32_t score;
+};
+
+struct StepObservation
+{
+    float player_y;
+    float player_angle;
+    float obstacle_x[STEP_OBSTACLES];
+    int32_t obstacle_height[STEP_OBSTACLES];
+};
+
+static_assert(sizeof(StepRequest) == 12, "StepRequest is part of the wire format");
+static_assert(sizeof(StepReply) == 16, "StepReply is part of the wire format");
+static_assert(sizeof(StepObservation) == 40, "StepObservation is part of the wire format");
+
+#endif
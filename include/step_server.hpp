@@ -0,0 +1,759 @@
+#ifndef SP_STEP_SERVER_HPP
+#define SP_STEP_SERVER_HPP
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <thread>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "game.hpp"
+#include "step_protocol.hpp"
+#include "step_shm.hpp"
+#include "observation.hpp"
+
+static_assert(NUM_OBSTACLES == STEP_OBSTACLES, "StepObservation must hold every pipe");
+
+
+inline WorldBase *make_session_world(unsigned seed, bool fixed)
+{
+    if (fixed)
+        return new FixedWorld(seed);
+    return new World(seed);
+}
+
+
+/**
+ * Collects session worlds and steps them as one batch through
+ * BasicWorld::step_all, in whichever physics the server runs. Every world
+ * added has to come from make_session_world with the same fixed.
+ */
+class SessionBatch
+{
+    public:
+        explicit SessionBatch(bool fixed) : fixed(fixed) {}
+
+        void add(WorldBase *world)
+        {
+            if (fixed)
+                fixed_worlds.push_back(static_cast<FixedWorld *>(world));
+            else
+                float_worlds.push_back(static_cast<World *>(world));
+        }
+
+        /**
+         * Step everything added since the last call, once
+         */
+        void step(int delta)
+        {
+            World::step_all(float_worlds.data(), float_worlds.size(), delta, float_batch);
+            FixedWorld::step_all(fixed_worlds.data(), fixed_worlds.size(), delta, fixed_batch);
+            float_worlds.clear();
+            fixed_worlds.clear();
+        }
+
+    private:
+        bool fixed;
+        std::vector<World *> float_worlds;
+        std::vector<FixedWorld *> fixed_worlds;
+        World::Batch float_batch;
+        FixedWorld::Batch fixed_batch;
+};
+
+
+/**
+ * Block SIGINT and SIGTERM and hand them out through a file descriptor,
+ * so server loops can shut down cleanly between requests
+ */
+inline int open_signal_fd()
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, nullptr);
+    return signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+
+/**
+ * Hosts headless game sessions for bots over a Unix domain socket (see
+ * step_protocol.hpp). A single thread runs an epoll loop; everything that
+ * arrives in one wakeup, from every client, is decoded first and then all
+ * the step requests are run as one batch step (SessionBatch) before any
+ * replies go out, so the per-request cost is a table lookup and a share of
+ * a vectorized world step rather than a syscall round trip.
+ *
+ * Runs until SIGINT or SIGTERM.
+ */
+class StepServer
+{
+    public:
+        /**
+         * @param path Where to create the socket
+         * @param step Tick length in milliseconds
+         * @param fixed Run sessions with fixed point physics
+         * @param max_sessions Refuse to open more than this many at once
+         */
+        StepServer(const std::string &path, int step, bool fixed,
+                   size_t max_sessions = 1 << 16)
+            : path(path), step(step), fixed(fixed), max_sessions(max_sessions),
+              listen_fd(-1), signal_fd(-1), epoll_fd(-1), stepper(fixed), open_sessions(0),
+              peak_sessions(0), steps(0), batches(0) {}
+
+        ~StepServer()
+        {
+            for (size_t fd = 0; fd < connections.size(); fd++)
+                if (connections[fd])
+                    close_connection(connections[fd].get());
+
+            if (listen_fd != -1) {
+                close(listen_fd);
+                unlink(path.c_str());
+            }
+            if (signal_fd != -1)
+                close(signal_fd);
+            if (epoll_fd != -1)
+                close(epoll_fd);
+        }
+
+        /**
+         * @return The process exit code
+         */
+        int run()
+        {
+            if (!listen_on_socket())
+                return 1;
+
+            std::cout << "Serving on " << path << std::endl;
+
+            epoll_event events[256];
+            bool running = true;
+
+            while (running) {
+                int n = epoll_wait(epoll_fd, events, 256, -1);
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    perror("epoll_wait");
+                    return 1;
+                }
+
+                ready.clear();
+
+                for (int i = 0; i < n; i++) {
+                    int fd = events[i].data.fd;
+
+                    if (fd == listen_fd) {
+                        accept_connections();
+                    } else if (fd == signal_fd) {
+                        running = false;
+                    } else {
+                        Connection *c = connections[fd].get();
+                        if (events[i].events & EPOLLOUT)
+                            flush(c);
+                        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                            receive(c);
+                        if (!c->pending.empty())
+                            ready.push_back(c);
+                    }
+                }
+
+                handle_requests();
+
+                for (Connection *c : ready)
+                    flush(c);
+
+                for (Connection *c : closing)
+                    close_connection(c);
+                closing.clear();
+            }
+
+            std::cout << "Served " << steps << " steps in " << batches << " batches ("
+                      << (batches ? steps / batches : 0) << " per batch), "
+                      << peak_sessions << " sessions at peak" << std::endl;
+            return 0;
+        }
+
+    private:
+        // Stop reading from a client that has this much unsent output
+        enum { OUT_LIMIT = 1 << 20 };
+
+        struct Connection
+        {
+            int fd;
+            uint32_t events;
+            bool closed;
+            std::vector<uint8_t> in;
+            std::vector<uint8_t> out;
+            size_t out_pos;
+            std::vector<StepRequest> pending;
+            size_t next;
+            std::vector<uint32_t> sessions;
+        };
+
+        struct Session
+        {
+            Session() : owner(nullptr), stepping(false), flap(false) {}
+
+            std::unique_ptr<WorldBase> world;
+            Connection *owner;
+            bool stepping;
+            bool flap;
+        };
+
+        bool listen_on_socket()
+        {
+            sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(addr.sun_path)) {
+                std::cerr << "Socket path too long: " << path << std::endl;
+                return false;
+            }
+            strcpy(addr.sun_path, path.c_str());
+
+            listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listen_fd == -1) {
+                perror("socket");
+                return false;
+            }
+
+            unlink(path.c_str());
+            if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) != 0 ||
+                listen(listen_fd, SOMAXCONN) != 0) {
+                perror(path.c_str());
+                return false;
+            }
+
+            signal_fd = open_signal_fd();
+
+            epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            if (signal_fd == -1 || epoll_fd == -1) {
+                perror("epoll");
+                return false;
+            }
+
+            watch(listen_fd, EPOLLIN, EPOLL_CTL_ADD);
+            watch(signal_fd, EPOLLIN, EPOLL_CTL_ADD);
+            return true;
+        }
+
+        void watch(int fd, uint32_t events, int op)
+        {
+            epoll_event event;
+            event.events = events;
+            event.data.fd = fd;
+            epoll_ctl(epoll_fd, op, fd, &event);
+        }
+
+        void accept_connections()
+        {
+            for (;;) {
+                int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd == -1)
+                    return;
+
+                if ((size_t)fd >= connections.size())
+                    connections.resize(fd + 1);
+
+                Connection *c = new Connection();
+                c->fd = fd;
+                c->events = EPOLLIN;
+                c->closed = false;
+                c->out_pos = 0;
+                c->next = 0;
+                connections[fd].reset(c);
+
+                watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+            }
+        }
+
+        /**
+         * Read everything the client has sent and decode whole requests
+         */
+        void receive(Connection *c)
+        {
+            if (c->closed)
+                return;
+
+            uint8_t buffer[1 << 16];
+            for (;;) {
+                ssize_t n = recv(c->fd, buffer, sizeof(buffer), 0);
+                if (n > 0) {
+                    c->in.insert(c->in.end(), buffer, buffer + n);
+                    continue;
+                }
+                if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                    drop(c);
+                if (n == 0 || errno != EINTR)
+                    break;
+            }
+
+            size_t count = c->in.size() / sizeof(StepRequest);
+            if (count == 0)
+                return;
+
+            size_t old = c->pending.size();
+            c->pending.resize(old + count);
+            memcpy(&c->pending[old], c->in.data(), count * sizeof(StepRequest));
+            c->in.erase(c->in.begin(), c->in.begin() + count * sizeof(StepRequest));
+        }
+
+        /**
+         * Run every decoded request. Requests are taken from each client
+         * in order until one touches a session that already has a step
+         * in the current batch; then the batch is stepped and the next
+         * round picks up where that left off, which keeps each session's
+         * requests in order however far ahead a client pipelines.
+         */
+        void handle_requests()
+        {
+            bool more = true;
+            while (more) {
+                more = false;
+                batch.clear();
+
+                for (Connection *c : ready) {
+                    while (!c->closed && c->next < c->pending.size()) {
+                        const StepRequest &req = c->pending[c->next];
+                        Session *s = find_session(c, req.session);
+                        if (req.op != STEP_OPEN && s != nullptr && s->stepping) {
+                            more = true;
+                            break;
+                        }
+
+                        c->next++;
+                        handle(c, req, s);
+                    }
+                }
+
+                step_batch();
+            }
+
+            for (Connection *c : ready) {
+                c->pending.clear();
+                c->next = 0;
+            }
+        }
+
+        void handle(Connection *c, const StepRequest &req, Session *s)
+        {
+            if (req.op == STEP_OPEN) {
+                open_session(c, req);
+                return;
+            }
+
+            if (s == nullptr) {
+                reply(c, req.op, STEP_BAD_SESSION, req.session, nullptr);
+                return;
+            }
+
+            switch (req.op) {
+                case STEP_RESET:
+                    s->world.reset(make_session_world(req.arg, fixed));
+                    reply(c, req.op, STEP_OK, req.session, s);
+                    break;
+
+                case STEP_STEP:
+                    s->stepping = true;
+                    s->flap = req.action != 0;
+                    batch.push_back(req.session);
+                    break;
+
+                case STEP_OBSERVE:
+                    reply(c, req.op, STEP_OK, req.session, s);
+                    observe(c, s);
+                    break;
+
+                case STEP_CLOSE:
+                    reply(c, req.op, STEP_OK, req.session, nullptr);
+                    close_session(req.session);
+                    break;
+
+                default:
+                    reply(c, req.op, STEP_BAD_OP, req.session, nullptr);
+            }
+        }
+
+        /**
+         * Advance every session with a step request in this round as one
+         * batch, with every bird's flight in one vectorized pass, then
+         * answer them all
+         */
+        void step_batch()
+        {
+            if (batch.empty())
+                return;
+
+            for (uint32_t id : batch) {
+                Session &s = sessions[id];
+                if (s.flap)
+                    s.world->flap();
+                stepper.add(s.world.get());
+            }
+            stepper.step(step);
+
+            for (uint32_t id : batch) {
+                Session &s = sessions[id];
+                s.stepping = false;
+                reply(s.owner, STEP_STEP, STEP_OK, id, &s);
+            }
+
+            steps += batch.size();
+            batches++;
+        }
+
+        void open_session(Connection *c, const StepRequest &req)
+        {
+            if (req.version != STEP_PROTOCOL_VERSION) {
+                reply(c, req.op, STEP_BAD_OP, 0, nullptr);
+                return;
+            }
+
+            uint32_t id;
+            if (!free_sessions.empty()) {
+                id = free_sessions.back();
+                free_sessions.pop_back();
+            } else if (sessions.size() < max_sessions) {
+                id = sessions.size();
+                sessions.push_back(Session());
+            } else {
+                reply(c, req.op, STEP_FULL, 0, nullptr);
+                return;
+            }
+
+            Session &s = sessions[id];
+            s.world.reset(make_session_world(req.arg, fixed));
+            s.owner = c;
+            s.stepping = false;
+            s.flap = false;
+            c->sessions.push_back(id);
+
+            open_sessions++;
+            peak_sessions = std::max(peak_sessions, open_sessions);
+
+            reply(c, req.op, STEP_OK, id, &s);
+        }
+
+        void close_session(uint32_t id)
+        {
+            Session &s = sessions[id];
+            std::vector<uint32_t> &owned = s.owner->sessions;
+            owned.erase(std::find(owned.begin(), owned.end(), id));
+
+            s.world.reset();
+            s.owner = nullptr;
+            free_sessions.push_back(id);
+            open_sessions--;
+        }
+
+        Session *find_session(Connection *c, uint32_t id)
+        {
+            if (id >= sessions.size() || sessions[id].owner != c)
+                return nullptr;
+            return &sessions[id];
+        }
+
+        void reply(Connection *c, uint8_t op, uint8_t status, uint32_t id, Session *s)
+        {
+            StepReply r;
+            memset(&r, 0, sizeof(r));
+            r.op = op;
+            r.status = status;
+            r.session = id;
+
+            if (s != nullptr) {
+                s->world->snapshot(snap);
+                r.dead = snap.dead;
+                r.tick = snap.tick;
+                r.score = snap.score;
+            }
+
+            append(c, &r, sizeof(r));
+        }
+
+        void observe(Connection *c, Session *s)
+        {
+            s->world->snapshot(snap);
+
+            StepObservation o;
+            o.player_y = snap.player_y;
+            o.player_angle = snap.player_angle;
+            for (int i = 0; i < NUM_OBSTACLES; i++) {
+                o.obstacle_x[i] = snap.obstacle_x[i];
+                o.obstacle_height[i] = snap.obstacle_height[i];
+            }
+
+            append(c, &o, sizeof(o));
+        }
+
+        void append(Connection *c, const void *data, size_t size)
+        {
+            const uint8_t *p = (const uint8_t *)data;
+            c->out.insert(c->out.end(), p, p + size);
+        }
+
+        /**
+         * Send as much queued output as the socket takes, and only ask for
+         * more input while the client is keeping up with its replies
+         */
+        void flush(Connection *c)
+        {
+            if (c->closed)
+                return;
+
+            while (c->out_pos < c->out.size()) {
+                ssize_t n = send(c->fd, &c->out[c->out_pos], c->out.size() - c->out_pos,
+                                 MSG_NOSIGNAL);
+                if (n > 0) {
+                    c->out_pos += n;
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                } else if (errno != EINTR) {
+                    drop(c);
+                    return;
+                }
+            }
+
+            if (c->out_pos == c->out.size()) {
+                c->out.clear();
+                c->out_pos = 0;
+            } else if (c->out_pos > c->out.size() / 2) {
+                c->out.erase(c->out.begin(), c->out.begin() + c->out_pos);
+                c->out_pos = 0;
+            }
+
+            size_t backlog = c->out.size() - c->out_pos;
+            uint32_t events = (backlog < OUT_LIMIT ? EPOLLIN : 0) | (backlog ? EPOLLOUT : 0);
+            if (events != c->events) {
+                watch(c->fd, events, EPOLL_CTL_MOD);
+                c->events = events;
+            }
+        }
+
+        /**
+         * Stop handling a connection; it is closed at the end of the
+         * current wakeup, once nothing refers to it any more
+         */
+        void drop(Connection *c)
+        {
+            if (!c->closed) {
+                c->closed = true;
+                closing.push_back(c);
+            }
+        }
+
+        void close_connection(Connection *c)
+        {
+            while (!c->sessions.empty())
+                close_session(c->sessions.back());
+
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+            close(c->fd);
+            connections[c->fd].reset();
+        }
+
+        std::string path;
+        int step;
+        bool fixed;
+        size_t max_sessions;
+
+        int listen_fd, signal_fd, epoll_fd;
+
+        std::vector<std::unique_ptr<Connection>> connections;
+        std::vector<Connection *> ready;
+        std::vector<Connection *> closing;
+
+        std::vector<Session> sessions;
+        std::vector<uint32_t> free_sessions;
+        std::vector<uint32_t> batch;
+        SessionBatch stepper;
+        WorldSnapshot snap;
+
+        size_t open_sessions, peak_sessions;
+        unsigned long steps, batches;
+};
+
+
+/**
+ * Serves a fixed set of sessions to one trainer through shared memory
+ * (see step_shm.hpp). Each command steps or resets a whole range of
+ * sessions, reading actions from and writing results to the segment's
+ * arrays in place. Between commands the loop spins briefly and then
+ * sleeps on a futex, so it only costs a core while it is being driven.
+ *
+ * Runs until the trainer sends STEP_CLOSE, or SIGINT or SIGTERM.
+ */
+class ShmStepServer
+{
+    public:
+        /**
+         * @param name The shared memory object to create, e.g. /cf-step
+         * @param sessions How many sessions the segment holds
+         * @param step Tick length in milliseconds
+         * @param fixed Run sessions with fixed point physics
+         * @param pixels Also draw every session into the segment's pixel
+         *        observations
+         */
+        ShmStepServer(const std::string &name, uint32_t sessions, int step, bool fixed,
+                      bool pixels = false)
+            : name(name), sessions(sessions), step(step), fixed(fixed), pixels(pixels),
+              created(false), signal_fd(-1), stepper(fixed), steps(0), commands(0) {}
+
+        ~ShmStepServer()
+        {
+            if (created)
+                shm_unlink(name.c_str());
+            if (signal_fd != -1)
+                close(signal_fd);
+        }
+
+        /**
+         * @return The process exit code
+         */
+        int run()
+        {
+            if (!segment.create(name, sessions, renderer.get_width(), renderer.get_height(),
+                                pixels ? renderer.get_stack() : 0))
+                return 1;
+            created = true;
+            signal_fd = open_signal_fd();
+
+            worlds.resize(sessions);
+            scores.resize(sessions);
+            for (uint32_t i = 0; i < sessions; i++) {
+                worlds[i].reset(make_session_world(i, fixed));
+                publish(i, true);
+            }
+
+            ShmHeader *header = segment.get_header();
+            header->step = step;
+            header->server_pid = getpid();
+            header->magic.store(SHM_MAGIC, std::memory_order_release);
+
+            std::cout << "Serving " << sessions << " sessions in shared memory "
+                      << name << std::endl;
+
+            bool running = true;
+            while (running) {
+                ShmCommand command;
+                if (!header->commands.pop_wait(command, -1, 100)) {
+                    signalfd_siginfo info;
+                    if (read(signal_fd, &info, sizeof(info)) > 0)
+                        running = false;
+                    continue;
+                }
+
+                ShmResult result = { command.op, STEP_OK, command.first, command.count };
+                if (command.first > sessions || command.count > sessions - command.first) {
+                    result.status = STEP_BAD_SESSION;
+                } else if (command.op == STEP_STEP) {
+                    step_range(command.first, command.count);
+                } else if (command.op == STEP_RESET) {
+                    reset_range(command.first, command.count, command.arg);
+                } else if (command.op == STEP_CLOSE) {
+                    running = false;
+                } else {
+                    result.status = STEP_BAD_OP;
+                }
+
+                while (!header->results.push(result))
+                    std::this_thread::yield();
+                commands++;
+            }
+
+            std::cout << "Served " << steps << " steps in " << commands << " commands"
+                      << std::endl;
+            return 0;
+        }
+
+    private:
+        void step_range(uint32_t first, uint32_t count)
+        {
+            const uint8_t *actions = segment.actions();
+            for (uint32_t i = first; i < first + count; i++) {
+                if (actions[i])
+                    worlds[i]->flap();
+                stepper.add(worlds[i].get());
+            }
+            stepper.step(step);
+
+            for (uint32_t i = first; i < first + count; i++)
+                publish(i);
+            steps += count;
+        }
+
+        void reset_range(uint32_t first, uint32_t count, uint32_t seed)
+        {
+            for (uint32_t i = first; i < first + count; i++) {
+                worlds[i].reset(make_session_world(seed + (i - first), fixed));
+                scores[i] = 0;
+                publish(i, true);
+            }
+        }
+
+        /**
+         * Write session i's state, reward and done flag into the segment,
+         * and draw it into its pixel observation if there are any
+         * @param fresh The session was just created or reset
+         */
+        void publish(uint32_t i, bool fresh = false)
+        {
+            worlds[i]->snapshot(snap);
+
+            StepObservation &o = segment.observations()[i];
+            o.player_y = snap.player_y;
+            o.player_angle = snap.player_angle;
+            for (int k = 0; k < NUM_OBSTACLES; k++) {
+                o.obstacle_x[k] = snap.obstacle_x[k];
+                o.obstacle_height[k] = snap.obstacle_height[k];
+            }
+
+            uint8_t &dead = segment.dead()[i];
+            float reward = (float)(snap.score - scores[i]);
+            if (snap.dead && !dead)
+                reward = -1;
+
+            segment.rewards()[i] = reward;
+            dead = snap.dead;
+            scores[i] = snap.score;
+
+            if (pixels) {
+                uint8_t *observation = segment.pixels() + i * renderer.observation_size();
+                if (fresh)
+                    renderer.reset(snap, observation);
+                else
+                    renderer.push(snap, observation);
+            }
+        }
+
+        std::string name;
+        uint32_t sessions;
+        int step;
+        bool fixed;
+        bool pixels;
+        bool created;
+        int signal_fd;
+
+        ShmSegment segment;
+        ObservationRenderer renderer;
+        std::vector<std::unique_ptr<WorldBase>> worlds;
+        SessionBatch stepper;
+        std::vector<int> scores;
+        WorldSnapshot snap;
+
+        unsigned long steps, commands;
+};
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef SP_STEP_SHM_HPP
+#define SP_STEP_SHM_HPP
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <cstring>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm_ring.hpp"
+#include "step_protocol.hpp"
+
+
+/*
+ * Shared memory transport for the step server (cf --serve-shm), for a
+ * trainer that wants more steps per second than a socket round trip
+ * allows. The server creates a POSIX shared memory object holding a fixed
+ * set of sessions; one trainer maps it and the two talk through a pair of
+ * SPSC rings of small commands.
+ *
+ * Per-session data is laid out as separate arrays so the trainer can use
+ * them in place, e.g. as numpy views: it writes actions[i] (1 to flap),
+ * pushes a STEP_STEP command for a range of sessions, and once the result
+ * comes back reads observations[i], rewards[i] and dead[i] for that
+ * range, which the server has written directly. Nothing is copied through
+ * the rings but the command itself.
+ *
+ * A server started with --shm-pixels also draws every session as a stack
+ * of small grayscale frames (see observation.hpp), for trainers that learn
+ * from pixels. The frame for a session's tick t is in slot t % stack, and
+ * t is the number of steps since the session was created or reset, so
+ * the newest frame is in slot t % stack and the oldest in (t + 1) % stack.
+ * A reset fills every slot with the session's first frame.
+ *
+ * Segment layout, each array starting on a 64 byte boundary:
+ *   ShmHeader (with both rings)
+ *   uint8_t actions[sessions]
+ *   StepObservation observations[sessions]
+ *   float rewards[sessions]   score gained by the last step, -1 on death
+ *   uint8_t dead[sessions]
+ *   uint8_t pixels[sessions][stack][height][width]   only with --shm-pixels
+ */
+
+#define SHM_MAGIC 0x50534643
+#define SHM_VERSION 2
+#define SHM_RING_SIZE 64
+
+struct ShmCommand
+{
+    /* STEP_STEP, STEP_RESET (arg + i seeds session i) or STEP_CLOSE,
+     * which shuts the server down */
+    uint32_t op;
+    uint32_t first;
+    uint32_t count;
+    uint32_t arg;
+};
+
+struct ShmResult
+{
+    uint32_t op;
+    uint32_t status;
+    uint32_t first;
+    uint32_t count;
+};
+
+struct ShmHeader
+{
+    /* Written last by the server, once the rest is ready */
+    std::atomic<uint32_t> magic;
+    uint32_t version;
+    uint32_t sessions;
+    uint32_t step;
+    uint32_t server_pid;
+
+    uint64_t size;
+    uint64_t actions_offset;
+    uint64_t observations_offset;
+    uint64_t rewards_offset;
+    uint64_t dead_offset;
+
+    /* All 0 if the server doesn't draw pixel observations */
+    uint64_t pixels_offset;
+    uint32_t pixel_width;
+    uint32_t pixel_height;
+    uint32_t pixel_stack;
+
+    sp::ShmRing<ShmCommand, SHM_RING_SIZE> commands;
+    sp::ShmRing<ShmResult, SHM_RING_SIZE> results;
+};
+
+
+/**
+ * A mapping of the segment, from either side
+ */
+class ShmSegment
+{
+    public:
+        ShmSegment() : header(nullptr), base(nullptr), size(0) {}
+
+        ~ShmSegment()
+        {
+            if (base != nullptr)
+                munmap(base, size);
+        }
+
+        /**
+         * Create and lay out a segment for the server. The header is left
+         * for the caller to finish and publish.
+         * @param pixel_width Size of the pixel observations' frames
+         * @param pixel_height
+         * @param pixel_stack How many frames each session keeps, 0 for no
+         *        pixel observations
+         */
+        bool create(const std::string &name, uint32_t sessions, uint32_t pixel_width = 0,
+                    uint32_t pixel_height = 0, uint32_t pixel_stack = 0)
+        {
+            size_t offset = align(sizeof(ShmHeader));
+            uint64_t actions = offset;
+            offset = align(offset + sessions);
+            uint64_t observations = offset;
+            offset = align(offset + sessions * sizeof(StepObservation));
+            uint64_t rewards = offset;
+            offset = align(offset + sessions * sizeof(float));
+            uint64_t dead = offset;
+            offset = align(offset + sessions);
+            uint64_t pixels = pixel_stack > 0 ? offset : 0;
+            offset = align(offset + (size_t)sessions * pixel_width * pixel_height * pixel_stack);
+
+            int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+            if (fd == -1 || ftruncate(fd, offset) != 0) {
+                perror(name.c_str());
+                if (fd != -1)
+                    close(fd);
+                return false;
+            }
+
+            if (!map(fd, offset))
+                return false;
+
+            header->magic.store(0, std::memory_order_relaxed);
+            header->version = SHM_VERSION;
+            header->sessions = sessions;
+            header->size = offset;
+            header->actions_offset = actions;
+            header->observations_offset = observations;
+            header->rewards_offset = rewards;
+            header->dead_offset = dead;
+            header->pixels_offset = pixels;
+            header->pixel_width = pixel_stack > 0 ? pixel_width : 0;
+            header->pixel_height = pixel_stack > 0 ? pixel_height : 0;
+            header->pixel_stack = pixel_stack;
+            header->commands.init();
+            header->results.init();
+            return true;
+        }
+
+        /**
+         * Map a segment a server has published
+         */
+        bool open(const std::string &name)
+        {
+            int fd = shm_open(name.c_str(), O_RDWR, 0);
+            struct stat info;
+            if (fd == -1 || fstat(fd, &info) != 0) {
+                perror(name.c_str());
+                if (fd != -1)
+                    close(fd);
+                return false;
+            }
+
+            if ((size_t)info.st_size < sizeof(ShmHeader) || !map(fd, info.st_size))
+                return false;
+
+            if (header->magic.load(std::memory_order_acquire) != SHM_MAGIC ||
+                header->version != SHM_VERSION || header->size > size) {
+                std::cerr << name << " is not a step server segment" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        ShmHeader *get_header() { return header; }
+
+        uint8_t *actions() { return base + header->actions_offset; }
+
+        StepObservation *observations()
+        {
+            return (StepObservation *)(base + header->observations_offset);
+        }
+
+        float *rewards() { return (float *)(base + header->rewards_offset); }
+
+        uint8_t *dead() { return base + header->dead_offset; }
+
+        /**
+         * Every session's stack of frames, or nullptr without pixels
+         */
+        uint8_t *pixels()
+        {
+            return header->pixels_offset != 0 ? base + header->pixels_offset : nullptr;
+        }
+
+    private:
+        ShmSegment(const ShmSegment &);
+        ShmSegment &operator=(const ShmSegment &);
+
+        static size_t align(size_t offset)
+        {
+            return (offset + 63) & ~(size_t)63;
+        }
+
+        bool map(int fd, size_t bytes)
+        {
+            void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED) {
+                perror("mmap");
+                return false;
+            }
+
+            base = (uint8_t *)p;
+            size = bytes;
+            header = (ShmHeader *)p;
+            return true;
+        }
+
+        ShmHeader *header;
+        uint8_t *base;
+        size_t size;
+};
+
+
+/**
+ * The trainer's end of the transport
+ */
+class ShmStepClient
+{
+    public:
+        bool open(const std::string &name)
+        {
+            return segment.open(name);
+        }
+
+        ShmSegment &get_segment()
+        {
+            return segment;
+        }
+
+        uint32_t get_sessions()
+        {
+            return segment.get_header()->sessions;
+        }
+
+        /**
+         * Queue a command without waiting for it. Results have to be
+         * collected with wait() before more than SHM_RING_SIZE commands
+         * are outstanding, or both sides stall.
+         */
+        void submit(uint32_t op, uint32_t first, uint32_t count, uint32_t arg = 0)
+        {
+            ShmCommand command = { op, first, count, arg };
+            while (!segment.get_header()->commands.push(command))
+                std::this_thread::yield();
+        }
+
+        /**
+         * Wait for the next result
+         */
+        ShmResult wait()
+        {
+            ShmResult result;
+            while (!segment.get_header()->results.pop_wait(result));
+            return result;
+        }
+
+        /**
+         * Step sessions [first, first + count) with the actions already
+         * written, and wait until their results are in place
+         */
+        uint32_t step(uint32_t first, uint32_t count)
+        {
+            submit(STEP_STEP, first, count);
+            return wait().status;
+        }
+
+        uint32_t reset(uint32_t first, uint32_t count, uint32_t seed)
+        {
+            submit(STEP_RESET, first, count, seed);
+            return wait().status;
+        }
+
+        /**
+         * Tell the server to exit
+         */
+        void shutdown()
+        {
+            submit(STEP_CLOSE, 0, 0);
+            wait();
+        }
+
+    private:
+        ShmSegment segment;
+};
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef SP_TASK_GRAPH_HPP
+#define SP_TASK_GRAPH_HPP
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+
+namespace sp {
+
+    /**
+     * A handful of jobs with dependencies between them, run as soon as
+     * what they need is done: each worker job on a thread of its own, and
+     * the jobs that have to stay on the calling thread (SDL's video calls)
+     * on it, in between waiting for the others. Meant for startup, where
+     * there are a few slow, mostly independent steps rather than many
+     * small ones, so there's no pool.
+     *
+     * A job that returns false fails the graph. Jobs that depend on it are
+     * skipped, everything else still runs, and run() returns false once
+     * it's all settled.
+     */
+    class TaskGraph
+    {
+        public:
+            typedef size_t Task;
+
+            enum Where {
+                WORKER,
+                MAIN_THREAD
+            };
+
+            /**
+             * Add a job to run
+             * @param name What it's called in the report
+             * @param where WORKER for its own thread, MAIN_THREAD for the one
+             *        calling run()
+             * @param work Prints why if it fails and returns false
+             * @param after The jobs that have to finish first
+             */
+            Task add(const std::string &name, Where where, std::function<bool()> work,
+                     std::vector<Task> after = std::vector<Task>())
+            {
+                Job job;
+                job.name = name;
+                job.where = where;
+                job.work = work;
+                job.after = after;
+                job.state = WAITING;
+                job.start = job.end = 0;
+                jobs.push_back(job);
+                return jobs.size() - 1;
+            }
+
+            /**
+             * Run every job and wait for them all
+             * @return false if any failed
+             */
+            bool run()
+            {
+                begin = Clock::now();
+                std::vector<std::thread> threads;
+                std::unique_lock<std::mutex> lock(mutex);
+
+                for (;;) {
+                    bool waiting = false, skipped = false;
+                    Task main_job = jobs.size();
+
+                    for (Task i = 0; i < jobs.size(); i++) {
+                        Job &job = jobs[i];
+                        if (job.state != WAITING)
+                            continue;
+
+                        State after = ready(job);
+                        if (after == FAILED) {
+                            job.state = SKIPPED;
+                            skipped = true;
+                        } else if (after != DONE) {
+                            waiting = true;
+                        } else if (job.where == WORKER) {
+                            job.state = RUNNING;
+                            threads.push_back(std::thread(&TaskGraph::execute, this, i));
+                        } else if (main_job == jobs.size()) {
+                            main_job = i;
+                        } else {
+                            waiting = true;
+                        }
+                    }
+
+                    // Whatever waits on a job skipped just now is skipped too,
+                    // even if it came earlier in the list
+                    if (skipped)
+                        continue;
+
+                    if (main_job < jobs.size()) {
+                        jobs[main_job].state = RUNNING;
+                        lock.unlock();
+                        execute(main_job);
+                        lock.lock();
+                        continue;
+                    }
+
+                    bool running = false;
+                    for (const Job &job : jobs)
+                        running = running || job.state == RUNNING;
+                    if (!waiting && !running)
+                        break;
+
+                    finished.wait(lock);
+                }
+
+                lock.unlock();
+                for (std::thread &thread : threads)
+                    thread.join();
+
+                for (const Job &job : jobs)
+                    if (job.state != DONE)
+                        return false;
+                return true;
+            }
+
+            /**
+             * When each job started and finished, in milliseconds from the
+             * start of run(), and on which thread
+             */
+            void report(std::ostream &out) const
+            {
+                double total = 0;
+                for (const Job &job : jobs)
+                    total = std::max(total, job.end);
+
+                out << "Startup took " << std::fixed << std::setprecision(1) << total << " ms\n";
+                for (const Job &job : jobs) {
+                    out << "  " << std::left << std::setw(14) << job.name
+                        << std::setw(8) << (job.where == WORKER ? "worker" : "main") << std::right;
+                    if (job.state == DONE || job.state == FAILED)
+                        out << std::setw(8) << job.start << " -> " << std::setw(8) << job.end
+                            << " ms" << std::setw(10) << job.end - job.start << " ms"
+                            << (job.state == FAILED ? "  failed" : "");
+                    else
+                        out << "  skipped";
+                    out << "\n";
+                }
+                out << std::flush;
+            }
+
+        private:
+            typedef std::chrono::steady_clock Clock;
+
+            enum State {
+                WAITING,
+                RUNNING,
+                DONE,
+                FAILED,
+                SKIPPED
+            };
+
+            struct Job
+            {
+                std::string name;
+                Where where;
+                std::function<bool()> work;
+                std::vector<Task> after;
+                State state;
+                double start, end;
+            };
+
+            /**
+             * DONE if everything the job needs is, FAILED if any of it
+             * failed or was skipped, otherwise WAITING
+             */
+            State ready(const Job &job) const
+            {
+                State state = DONE;
+                for (Task i : job.after) {
+                    if (jobs[i].state == FAILED || jobs[i].state == SKIPPED)
+                        return FAILED;
+                    if (jobs[i].state != DONE)
+                        state = WAITING;
+                }
+                return state;
+            }
+
+            double elapsed_ms() const
+            {
+                return std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+            }
+
+            void execute(Task i)
+            {
+                double start = elapsed_ms();
+                bool ok = jobs[i].work();
+                double end = elapsed_ms();
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    jobs[i].start = start;
+                    jobs[i].end = end;
+                    jobs[i].state = ok ? DONE : FAILED;
+                }
+                finished.notify_all();
+            }
+
+            std::vector<Job> jobs;
+            Clock::time_point begin;
+            std::mutex mutex;
+            std::condition_variable finished;
+    };
+
+}
+
+#endif
@@ -0,0 +1,300 @@
+#ifndef SP_TELEMETRY_HPP
+#define SP_TELEMETRY_HPP
+
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/*
+ * Live counters and latency histograms, published to a POSIX shared
+ * memory object so a running game (or step server) can be watched from
+ * outside with cf-stat, without a debugger and without the game doing any
+ * reporting of its own.
+ *
+ * Every update is a single relaxed fetch_add on a 64 bit word, so it is
+ * wait-free from any thread and costs a few nanoseconds. Counters are
+ * bumped from the hot paths of several threads at once (every tick, every
+ * collision pass, every allocation), so each one is split into shards on
+ * cache lines of their own, a thread always adds to the same shard, and
+ * readers sum the shards. Before the segment is published, or if it never
+ * is, updates land in a private copy of the same layout, so callers never
+ * need to check.
+ *
+ * The layout is self-describing: the header carries a version, how many
+ * counters and histograms follow and how the buckets are split, and each
+ * entry carries its name, so a reader built against an older list still
+ * shows everything. The magic is written last, once the rest is in place.
+ *
+ * Histograms are HDR-style log-linear over nanoseconds: the values below
+ * 2^TELEMETRY_SUB_BITS get a bucket each, and every power of two above
+ * that is split into 2^TELEMETRY_SUB_BITS linear buckets, so any value is
+ * within 1/16 of its bucket's lower bound across the whole 64 bit range.
+ */
+
+#define TELEMETRY_MAGIC 0x4d544643
+#define TELEMETRY_VERSION 2
+#define TELEMETRY_NAME_SIZE 32
+#define TELEMETRY_SUB_BITS 4
+#define TELEMETRY_BUCKETS ((64 - TELEMETRY_SUB_BITS + 1) << TELEMETRY_SUB_BITS)
+#define TELEMETRY_SHARDS 16
+
+
+namespace sp {
+
+    struct TelemetryHeader
+    {
+        std::atomic<uint32_t> magic;
+        uint32_t version;
+        uint32_t counters;
+        uint32_t histograms;
+        uint32_t buckets;
+        uint32_t sub_bits;
+        uint32_t shards;
+        uint32_t pid;
+        uint64_t start_time;
+        uint64_t size;
+        uint64_t counters_offset;
+        uint64_t histograms_offset;
+    };
+
+    /* One cache line each, so threads on different shards never share one */
+    struct alignas(64) TelemetryShard
+    {
+        std::atomic<uint64_t> value;
+    };
+
+    struct alignas(64) TelemetryCounter
+    {
+        char name[TELEMETRY_NAME_SIZE];
+        TelemetryShard shards[TELEMETRY_SHARDS];
+
+        /* The count so far, across every thread */
+        uint64_t total() const
+        {
+            uint64_t sum = 0;
+            for (int i = 0; i < TELEMETRY_SHARDS; i++)
+                sum += shards[i].value.load(std::memory_order_relaxed);
+            return sum;
+        }
+    };
+
+    struct alignas(64) TelemetryHistogram
+    {
+        char name[TELEMETRY_NAME_SIZE];
+        /* Sum of every value recorded, for the mean; the count is the sum
+         * of the buckets */
+        std::atomic<uint64_t> sum;
+        alignas(64) std::atomic<uint64_t> buckets[TELEMETRY_BUCKETS];
+    };
+
+
+    /**
+     * Which bucket a value goes in
+     */
+    inline unsigned telemetry_bucket(uint64_t value)
+    {
+        if (value < (1u << TELEMETRY_SUB_BITS))
+            return value;
+        unsigned exponent = 63 - __builtin_clzll(value);
+        unsigned shift = exponent - TELEMETRY_SUB_BITS;
+        return (shift << TELEMETRY_SUB_BITS) + (value >> shift);
+    }
+
+    /**
+     * The smallest value that goes in a bucket
+     */
+    inline uint64_t telemetry_bucket_low(unsigned bucket)
+    {
+        if (bucket < (2u << TELEMETRY_SUB_BITS))
+            return bucket;
+        unsigned shift = (bucket >> TELEMETRY_SUB_BITS) - 1;
+        uint64_t mantissa = (bucket & ((1u << TELEMETRY_SUB_BITS) - 1)) | (1u << TELEMETRY_SUB_BITS);
+        return mantissa << shift;
+    }
+
+
+    /**
+     * The process' telemetry. Everything is static so that code anywhere,
+     * including operator new, can count without being handed an object.
+     */
+    class Telemetry
+    {
+        public:
+            enum Counter {
+                FRAMES,
+                TICKS,
+                COLLISIONS_TESTED,
+                COLLISIONS_HIT,
+                DRAW_CALLS,
+                AUDIO_TRIGGERS,
+                ALLOCATIONS,
+                NUM_COUNTERS
+            };
+
+            enum Histogram {
+                FRAME_TIME,
+                SIMULATE_TIME,
+                PRESENT_TIME,
+                INPUT_LATENCY,
+                NUM_HISTOGRAMS
+            };
+
+            /**
+             * The segment as laid out for this build's counters
+             */
+            struct Segment
+            {
+                TelemetryHeader header;
+                TelemetryCounter counters[NUM_COUNTERS];
+                TelemetryHistogram histograms[NUM_HISTOGRAMS];
+            };
+
+            static void count(Counter counter, uint64_t n = 1)
+            {
+                current()->counters[counter].shards[shard()].value.fetch_add(n, std::memory_order_relaxed);
+            }
+
+            /**
+             * Add a value, in nanoseconds, to a histogram
+             */
+            static void record(Histogram histogram, uint64_t ns)
+            {
+                TelemetryHistogram &h = current()->histograms[histogram];
+                h.buckets[telemetry_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+                h.sum.fetch_add(ns, std::memory_order_relaxed);
+            }
+
+            /**
+             * A monotonic clock to time things with, in nanoseconds
+             */
+            static uint64_t now()
+            {
+                using namespace std::chrono;
+                return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+            }
+
+            /**
+             * Move the telemetry into a shared memory object for cf-stat to
+             * read, carrying over whatever has been counted so far. Call
+             * before starting any threads that count.
+             * @param name A shm_open name, like /cf-stats
+             */
+            static bool publish(const char *name)
+            {
+                int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+                if (fd == -1 || ftruncate(fd, sizeof(Segment)) != 0) {
+                    perror(name);
+                    if (fd != -1)
+                        close(fd);
+                    return false;
+                }
+
+                void *p = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                close(fd);
+                if (p == MAP_FAILED) {
+                    perror("mmap");
+                    return false;
+                }
+
+                // The new object is all zeros, which is an empty segment
+                Segment *shared = (Segment *)p;
+                Segment *local = current();
+                describe(*shared);
+                for (int i = 0; i < NUM_COUNTERS; i++)
+                    for (int j = 0; j < TELEMETRY_SHARDS; j++)
+                        shared->counters[i].shards[j].value.store(local->counters[i].shards[j].value.load());
+                for (int i = 0; i < NUM_HISTOGRAMS; i++) {
+                    shared->histograms[i].sum.store(local->histograms[i].sum.load());
+                    for (int b = 0; b < TELEMETRY_BUCKETS; b++)
+                        shared->histograms[i].buckets[b].store(local->histograms[i].buckets[b].load());
+                }
+                shared->header.magic.store(TELEMETRY_MAGIC, std::memory_order_release);
+
+                current() = shared;
+                published() = name;
+                return true;
+            }
+
+            /**
+             * Remove the shared memory object, if there is one. The mapping
+             * stays, so late updates are harmless.
+             */
+            static void unpublish()
+            {
+                if (published() != nullptr)
+                    shm_unlink(published());
+                published() = nullptr;
+            }
+
+        private:
+            static void describe(Segment &segment)
+            {
+                static const char *counter_names[NUM_COUNTERS] = {
+                    "frames", "ticks", "collisions_tested", "collisions_hit",
+                    "draw_calls", "audio_triggers", "allocations"
+                };
+                static const char *histogram_names[NUM_HISTOGRAMS] = {
+                    "frame_time", "simulate_time", "present_time", "input_latency"
+                };
+
+                TelemetryHeader &header = segment.header;
+                header.version = TELEMETRY_VERSION;
+                header.counters = NUM_COUNTERS;
+                header.histograms = NUM_HISTOGRAMS;
+                header.buckets = TELEMETRY_BUCKETS;
+                header.sub_bits = TELEMETRY_SUB_BITS;
+                header.shards = TELEMETRY_SHARDS;
+                header.pid = getpid();
+                header.start_time = time(nullptr);
+                header.size = sizeof(Segment);
+                header.counters_offset = (char *)segment.counters - (char *)&segment;
+                header.histograms_offset = (char *)segment.histograms - (char *)&segment;
+
+                for (int i = 0; i < NUM_COUNTERS; i++)
+                    strncpy(segment.counters[i].name, counter_names[i], TELEMETRY_NAME_SIZE - 1);
+                for (int i = 0; i < NUM_HISTOGRAMS; i++)
+                    strncpy(segment.histograms[i].name, histogram_names[i], TELEMETRY_NAME_SIZE - 1);
+            }
+
+            /* Statically zeroed, so counting works before main and from
+             * inside operator new */
+            static Segment *&current()
+            {
+                static Segment local;
+                static Segment *segment = &local;
+                return segment;
+            }
+
+            /**
+             * The calling thread's shard, handed out in turn the first time
+             * a thread counts. Past TELEMETRY_SHARDS threads they double
+             * up, which is still correct, just shared.
+             */
+            static unsigned shard()
+            {
+                static std::atomic<unsigned> next(0);
+                static thread_local unsigned index = TELEMETRY_SHARDS;
+                if (index == TELEMETRY_SHARDS)
+                    index = next.fetch_add(1, std::memory_order_relaxed) % TELEMETRY_SHARDS;
+                return index;
+            }
+
+            static const char *&published()
+            {
+                static const char *name = nullptr;
+                return name;
+            }
+    };
+
+}
+
+#endif
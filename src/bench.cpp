@@ -0,0 +1,508 @@
+/*
+ * Benchmarks, written out as JSON so two builds can be compared.
+ *
+ * Micro benchmarks time the game's hot pieces in process: collision
+ * checks, collision dispatch with more and more entities, the bird's
+ * update, a flock of ghosts' flight in float and in fixed point, pipe
+ * recycling, score digits, the state hash, a pixel observation and a
+ * whole world step, alone and for a batch of worlds at once.
+ *
+ * Macro benchmarks time full frames of the real game, by playing a fixed
+ * seed, autopilot replay through cf --headless on SDL's dummy video and
+ * audio drivers (so the software renderer), alone and with a thousand
+ * ghosts.
+ *
+ * Every benchmark is sampled repeatedly and reported as the median time
+ * per operation with its median absolute deviation, which a stray slow
+ * sample (a page fault, another process) barely moves. Compare medians,
+ * and treat differences within a couple of MADs as noise.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <memory>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <ctime>
+
+#include <unistd.h>
+
+#include "game.hpp"
+#include "observation.hpp"
+
+// How this was compiled, for bench.json
+#ifndef BENCH_CFLAGS
+#define BENCH_CFLAGS "unknown"
+#endif
+
+
+/**
+ * Keep the compiler from optimizing away a result nobody reads
+ */
+template <typename T>
+inline void keep(const T &value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+
+struct Result
+{
+    std::string suite, name, unit;
+    unsigned long iterations;
+    std::vector<double> samples;
+};
+
+
+static double now_ns()
+{
+    using namespace std::chrono;
+    return duration_cast<duration<double, std::nano>>(steady_clock::now().time_since_epoch()).count();
+}
+
+
+static double median(std::vector<double> values)
+{
+    if (values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+
+/**
+ * Median absolute deviation from the median
+ */
+static double mad(const std::vector<double> &values)
+{
+    double m = median(values);
+    std::vector<double> deviations;
+    for (double v : values)
+        deviations.push_back(std::fabs(v - m));
+    return median(deviations);
+}
+
+
+/**
+ * Time body(n), which does n operations. n is doubled until one call
+ * takes a couple of milliseconds, so timer resolution and call overhead
+ * don't show, then that many are timed samples times after a warm up.
+ */
+template <typename Body>
+static Result measure(const char *name, int samples, Body body)
+{
+    Result result;
+    result.suite = "micro";
+    result.name = name;
+    result.unit = "ns/op";
+
+    unsigned long n = 1;
+    for (;;) {
+        double start = now_ns();
+        body(n);
+        if (now_ns() - start >= 2e6 || n >= (1ul << 30))
+            break;
+        n *= 2;
+    }
+    result.iterations = n;
+
+    body(n);
+    for (int i = 0; i < samples; i++) {
+        double start = now_ns();
+        body(n);
+        result.samples.push_back((now_ns() - start) / n);
+    }
+    return result;
+}
+
+
+/**
+ * A flock of 1024 birds flown with the array fly(), restarted every
+ * hundred steps so they aren't all lying dead on the ground
+ */
+template <typename Real>
+static Result fly_flock(const char *name, int samples)
+{
+    const size_t birds = 1024;
+    std::vector<Real> y, y_v, rotation;
+    std::vector<uint8_t> dead;
+
+    return measure(name, samples, [&](unsigned long n) {
+        for (unsigned long i = 0; i < n; i++) {
+            if (i % 100 == 0) {
+                y.assign(birds, Real(SCREEN_HEIGHT / 2 - 60));
+                y_v.assign(birds, Real(ArcadeRules::flap_speed));
+                rotation.assign(birds, Real(0));
+                dead.assign(birds, 0);
+            }
+            fly<ArcadeRules>(y.data(), y_v.data(), rotation.data(), dead.data(), birds, 10);
+        }
+        keep(y[0]);
+    });
+}
+
+
+static void micro(std::vector<Result> &results, int samples, const std::string &filter)
+{
+    auto wanted = [&](const std::string &name) {
+        return name.find(filter) != std::string::npos;
+    };
+
+    if (wanted("check_collision")) {
+        Random random(1);
+        std::vector<SDL_Rect> a(1024), b(1024);
+        for (size_t i = 0; i < a.size(); i++) {
+            a[i] = { random.range(0, SCREEN_WIDTH), random.range(0, SCREEN_HEIGHT), BIRD_WIDTH, BIRD_HEIGHT };
+            b[i] = { random.range(0, SCREEN_WIDTH), random.range(0, SCREEN_HEIGHT), 52, random.range(1, 200) };
+        }
+
+        results.push_back(measure("check_collision", samples, [&](unsigned long n) {
+            int hits = 0;
+            for (unsigned long i = 0; i < n; i++)
+                hits += CollisionBank::check_collision(a[i & 1023], b[i & 1023]);
+            keep(hits);
+        }));
+    }
+
+    // A bird against a growing field of pipes, all in motion
+    const int pipe_counts[] = { 4, 16, 64 };
+    for (int pipes : pipe_counts) {
+        std::string name = "dispatch_collisions/" + std::to_string(pipes);
+        if (!wanted(name))
+            continue;
+
+        Random random(2);
+        FlappyFuch bird(SCREEN_WIDTH / 12, SCREEN_HEIGHT / 2 - 60);
+        std::vector<Obstacle> obstacles;
+        for (int i = 0; i < pipes; i++)
+            obstacles.push_back(World::make_obstacle(i * SCREEN_WIDTH / pipes, random.range(0, 200)));
+
+        CollisionBank bank;
+        bank.register_entity(&bird);
+        for (Obstacle &obstacle : obstacles) {
+            obstacle.update(10);
+            bank.register_entity(&obstacle);
+        }
+
+        results.push_back(measure(name.c_str(), samples, [&](unsigned long n) {
+            for (unsigned long i = 0; i < n; i++)
+                bank.dispatch_collisions();
+        }));
+    }
+
+    if (wanted("flappy_update")) {
+        FlappyFuch bird(SCREEN_WIDTH / 12, SCREEN_HEIGHT / 2 - 60);
+        bird.set_active();
+
+        results.push_back(measure("flappy_update", samples, [&](unsigned long n) {
+            for (unsigned long i = 0; i < n; i++) {
+                if (i % 30 == 0)
+                    bird.flap();
+                bird.update(10);
+                if (bird.is_dead()) {
+                    bird.set_alive();
+                    bird.set_y(SCREEN_HEIGHT / 2 - 60);
+                }
+            }
+        }));
+    }
+
+    // What World::step does to a pipe that has scrolled off the left
+    if (wanted("pipe_recycle")) {
+        Random random(3);
+        std::vector<Obstacle> obstacles;
+        for (int i = 0; i < NUM_OBSTACLES; i++)
+            obstacles.push_back(World::make_obstacle(600 + i * 200, random.range(0, 200)));
+
+        results.push_back(measure("pipe_recycle", samples, [&](unsigned long n) {
+            for (unsigned long i = 0; i < n; i++) {
+                Obstacle &obstacle = obstacles[i % NUM_OBSTACLES];
+                obstacle.set_x(obstacles[(i + NUM_OBSTACLES - 1) % NUM_OBSTACLES].get_exact_x() + 200);
+                obstacle.set_height(random.range(0, SCREEN_HEIGHT - 60 - 12 * 4 - ArcadeRules::pipe_gap));
+                obstacle.clear_motion();
+            }
+        }));
+    }
+
+    // The ghosts' flight: a flock of birds stepped in one pass over arrays,
+    // in float and in fixed point
+    if (wanted("fly_flock/"))
+        results.push_back(fly_flock<float>("fly_flock/1024", samples));
+    if (wanted("fly_flock_fixed/"))
+        results.push_back(fly_flock<sp::Fixed>("fly_flock_fixed/1024", samples));
+
+    if (wanted("digit_to_array")) {
+        results.push_back(measure("digit_to_array", samples, [&](unsigned long n) {
+            size_t digits = 0;
+            for (unsigned long i = 0; i < n; i++)
+                digits += digit_to_array(i % 100000).size();
+            keep(digits);
+        }));
+    }
+
+    // What every step pays to keep the state hash up to date
+    if (wanted("state_hash")) {
+        World world(4);
+        world.flap();
+        world.step(10);
+
+        results.push_back(measure("state_hash", samples, [&](unsigned long n) {
+            uint64_t h = 0;
+            for (unsigned long i = 0; i < n; i++) {
+                StateHash hash;
+                world.hash_state(hash);
+                h = hash.chain(h);
+            }
+            keep(h);
+        }));
+    }
+
+    // What the shared memory step server adds per session step with
+    // --shm-pixels: one 84x84 frame drawn into a stack of four
+    if (wanted("observation_push")) {
+        World world(4);
+        WorldSnapshot snap;
+        world.flap();
+        world.step(10);
+        world.snapshot(snap);
+
+        ObservationRenderer renderer;
+        std::vector<uint8_t> observation(renderer.observation_size());
+
+        results.push_back(measure("observation_push", samples, [&](unsigned long n) {
+            for (unsigned long i = 0; i < n; i++) {
+                snap.tick = i;
+                renderer.push(snap, observation.data());
+            }
+            keep(observation[0]);
+        }));
+    }
+
+    // A whole tick, flown by the autopilot, starting over on death
+    if (wanted("world_step")) {
+        World world(4);
+        WorldSnapshot snap;
+
+        results.push_back(measure("world_step", samples, [&](unsigned long n) {
+            for (unsigned long i = 0; i < n; i++) {
+                world.snapshot(snap);
+                if (snap.dead)
+                    world.reset();
+                if (snap.idle || autopilot(snap))
+                    world.flap();
+                world.step(10);
+            }
+        }));
+    }
+
+    // The same ticks for 1024 worlds at once the way the step servers run
+    // them
+    if (wanted("world_step_all")) {
+        const size_t count = 1024;
+        std::vector<std::unique_ptr<World>> worlds;
+        std::vector<World *> pointers;
+        for (size_t i = 0; i < count; i++) {
+            worlds.emplace_back(new World(4 + i));
+            pointers.push_back(worlds.back().get());
+        }
+        World::Batch batch;
+        WorldSnapshot snap;
+
+        results.push_back(measure("world_step_all/1024", samples, [&](unsigned long n) {
+            for (unsigned long i = 0; i < n; i++) {
+                for (World *world : pointers) {
+                    world->snapshot(snap);
+                    if (snap.dead) world->reset();
+                    if (snap.idle || autopilot(snap)) world->flap();
+                }
+                World::step_all(pointers.data(), count, 10, batch);
+            }
+        }));
+    }
+}
+
+
+/**
+ * Run a command and return what it printed
+ */
+static bool run(const std::string &command, std::string &output)
+{
+    FILE *pipe = popen(command.c_str(), "r");
+    if (pipe == nullptr)
+        return false;
+
+    char buffer[4096];
+    size_t n;
+    output.clear();
+    while ((n = fread(buffer, 1, sizeof(buffer), pipe)) > 0)
+        output.append(buffer, n);
+    return pclose(pipe) == 0;
+}
+
+
+static bool macro(std::vector<Result> &results, int samples, const std::string &filter,
+                  const std::string &cf)
+{
+    char dir[] = "/tmp/cf-bench-XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        perror("mkdtemp");
+        return false;
+    }
+    std::string replay = std::string(dir) + "/run.cfr";
+    std::string ghosts = std::string(dir) + "/ghosts.cfr";
+
+    // The first autopilot run on seed 1 is the scripted input for every
+    // frame benchmark, and the same seed's corpus supplies the ghosts
+    std::string output;
+    if (!run(cf + " --seed 1 --make-ghosts " + replay + " --ghost-count 1", output) ||
+        !run(cf + " --seed 1 --make-ghosts " + ghosts + " --ghost-count 1000", output)) {
+        std::cerr << "Failed to record the benchmark replays with " << cf << std::endl;
+        return false;
+    }
+
+    struct Case
+    {
+        const char *name;
+        std::string arguments;
+    } cases[] = {
+        { "frames", "" },
+        { "frames_ghosts/1000", " --ghosts " + ghosts + " --ghost-count 1000" }
+    };
+
+    bool ok = true;
+    for (const Case &c : cases) {
+        if (std::string(c.name).find(filter) == std::string::npos)
+            continue;
+
+        Result result;
+        result.suite = "macro";
+        result.name = c.name;
+        result.unit = "ns/frame";
+        result.iterations = 0;
+
+        std::string command = "SDL_VIDEODRIVER=dummy SDL_AUDIODRIVER=dummy " + cf +
+                              " --replay " + replay + " --headless" + c.arguments;
+
+        for (int i = 0; i <= samples && ok; i++) {
+            unsigned long frames = 0;
+            double seconds = 0;
+            const char *line;
+            if (!run(command, output) ||
+                (line = strstr(output.c_str(), "Rendered ")) == nullptr ||
+                sscanf(line, "Rendered %lu frames in %lf s", &frames, &seconds) != 2 ||
+                frames == 0) {
+                std::cerr << "Failed to run " << command << std::endl;
+                ok = false;
+                break;
+            }
+
+            // The first run only warms the caches
+            if (i > 0)
+                result.samples.push_back(seconds * 1e9 / frames);
+            result.iterations = frames;
+        }
+
+        if (ok)
+            results.push_back(result);
+    }
+
+    unlink(replay.c_str());
+    unlink(ghosts.c_str());
+    rmdir(dir);
+    return ok;
+}
+
+
+static void write_json(std::ostream &out, const std::vector<Result> &results,
+                       const std::string &cf, const std::string &cf_cflags)
+{
+    char date[32];
+    time_t now = time(nullptr);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    out << "{\n  \"date\": \"" << date << "\",\n"
+        << "  \"compiler\": \"" << __VERSION__ << "\",\n"
+        << "  \"cflags\": \"" << BENCH_CFLAGS << "\",\n"
+        << "  \"cf\": \"" << cf << "\",\n"
+        << "  \"cf_cflags\": \"" << cf_cflags << "\",\n"
+        << "  \"benchmarks\": [";
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        out << (i ? ",\n" : "\n")
+            << "    {\"suite\": \"" << r.suite << "\", \"name\": \"" << r.name
+            << "\", \"unit\": \"" << r.unit << "\", \"median\": " << median(r.samples)
+            << ", \"mad\": " << mad(r.samples)
+            << ", \"min\": " << *std::min_element(r.samples.begin(), r.samples.end())
+            << ", \"max\": " << *std::max_element(r.samples.begin(), r.samples.end())
+            << ", \"samples\": " << r.samples.size()
+            << ", \"iterations\": " << r.iterations << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+
+int main(int argc, char **argv)
+{
+    bool run_micro = true, run_macro = true;
+    int samples = 21;
+    int macro_samples = 7;
+    std::string filter;
+    std::string cf = "./cf";
+    std::string cf_cflags = "unknown";
+    const char *out_path = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--micro")) {
+            run_macro = false;
+        } else if (!strcmp(argv[i], "--macro")) {
+            run_micro = false;
+        } else if (!strcmp(argv[i], "--samples") && i + 1 < argc) {
+            samples = macro_samples = std::max(3, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (!strcmp(argv[i], "--cf") && i + 1 < argc) {
+            cf = argv[++i];
+        } else if (!strcmp(argv[i], "--cf-cflags") && i + 1 < argc) {
+            cf_cflags = argv[++i];
+        } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+            out_path = argv[++i];
+        } else {
+            std::cerr << "usage: " << argv[0]
+                      << " [--micro | --macro] [--samples N] [--filter TEXT]"
+                         " [--cf PATH] [--cf-cflags FLAGS] [--out FILE.json]\n";
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+    if (run_micro)
+        micro(results, samples, filter);
+    if (run_macro && !macro(results, macro_samples, filter, cf))
+        return 1;
+
+    for (const Result &r : results) {
+        fprintf(stderr, "%-6s %-24s %12.1f %-8s +- %.1f\n", r.suite.c_str(), r.name.c_str(),
+                median(r.samples), r.unit.c_str(), mad(r.samples));
+    }
+
+    if (out_path != nullptr) {
+        std::ofstream out(out_path);
+        write_json(out, results, cf, cf_cflags);
+        if (out.fail()) {
+            std::cerr << "Failed to write " << out_path << std::endl;
+            return 1;
+        }
+    } else {
+        write_json(std::cout, results, cf, cf_cflags);
+    }
+    return 0;
+}
@@ -0,0 +1,414 @@
+/*
+ * Finds where two runs that should have played the same stopped doing so.
+ *
+ * Given two replays it compares the state hashes recorded in them, then
+ * plays both back on this build tick by tick, hashing every step, to find
+ * the first tick the worlds differ and show both snapshots there. If both
+ * replays have the same inputs and still recorded different hashes, the
+ * builds or machines that recorded them disagree, and replaying each
+ * against its own hashes tells which of them this build agrees with.
+ *
+ * Given two run logs (say, the same sweep on two machines) it matches
+ * runs by seed and reports the ones whose final state hashes differ.
+ *
+ * Exits 0 if the runs agree, 1 if they diverge and 2 if they can't be read.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <string>
+#include <memory>
+#include <cstring>
+
+#include "game.hpp"
+#include "replay.hpp"
+#include "run_log.hpp"
+
+
+/**
+ * A replay taken apart: its inputs and its recorded hashes, in tick order
+ */
+struct Recording
+{
+    std::string path;
+    ReplayHeader header;
+    std::vector<std::pair<unsigned long, InputType> > inputs;
+    std::vector<std::pair<unsigned long, uint64_t> > hashes;
+    unsigned long end_tick;
+};
+
+
+static bool read_file(const char *path, std::vector<uint8_t> &data)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (in.fail()) {
+        std::cerr << "Failed to open " << path << std::endl;
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+}
+
+
+static bool load_recording(const char *path, const std::vector<uint8_t> &data,
+                           Recording &recording)
+{
+    ReplayCursor cursor;
+    if (!cursor.open(data.data(), data.size(), recording.header)) {
+        std::cerr << path << " is not a replay this build can read" << std::endl;
+        return false;
+    }
+
+    recording.path = path;
+    recording.end_tick = 0;
+
+    unsigned long tick;
+    ReplayEvent event;
+    while (cursor.next(tick, event)) {
+        if (event == REPLAY_FLAP || event == REPLAY_RESET)
+            recording.inputs.push_back(std::make_pair(tick, (InputType)event));
+        else if (event == REPLAY_HASH)
+            recording.hashes.push_back(std::make_pair(tick, cursor.get_hash()));
+        recording.end_tick = tick;
+    }
+    return true;
+}
+
+
+/**
+ * One recording being played back on this build
+ */
+class Playback
+{
+    public:
+        Playback(const Recording &recording)
+            : recording(recording), next_input(0), next_hash(0), tick(0),
+              mismatch(false), mismatch_tick(0), last_match(0), have_match(false)
+        {
+            if (recording.header.flags & REPLAY_FIXED)
+                world.reset(new FixedWorld(recording.header.seed));
+            else
+                world.reset(new World(recording.header.seed));
+            world->snapshot(snap);
+        }
+
+        bool finished() const
+        {
+            return tick >= recording.end_tick;
+        }
+
+        /**
+         * Apply this tick's inputs, step, and check the step against the
+         * hash recorded for it, if there is one
+         */
+        void step()
+        {
+            const auto &inputs = recording.inputs;
+            for (; next_input < inputs.size() && inputs[next_input].first == tick; next_input++) {
+                if (inputs[next_input].second == INPUT_FLAP)
+                    world->flap();
+                else
+                    world->reset();
+            }
+
+            world->step(recording.header.step);
+            world->snapshot(snap);
+
+            const auto &hashes = recording.hashes;
+            for (; next_hash < hashes.size() && hashes[next_hash].first == tick; next_hash++) {
+                if (hashes[next_hash].second == snap.state_hash) {
+                    if (!mismatch) {
+                        last_match = tick;
+                        have_match = true;
+                    }
+                } else if (!mismatch) {
+                    mismatch = true;
+                    mismatch_tick = tick;
+                }
+            }
+            tick++;
+        }
+
+        const Recording &recording;
+        std::unique_ptr<WorldBase> world;
+        WorldSnapshot snap;
+        size_t next_input, next_hash;
+        unsigned long tick;
+
+        // The first recorded hash this build disagrees with, and the last
+        // one before it that it agreed with
+        bool mismatch;
+        unsigned long mismatch_tick, last_match;
+        bool have_match;
+};
+
+
+static void print_row(const char *name, const std::string &a, const std::string &b)
+{
+    std::cout << (a == b ? "  " : "* ") << std::left << std::setw(22) << name
+              << std::setw(24) << a << b << std::right << "\n";
+}
+
+static void print_header()
+{
+    std::cout << "  " << std::left << std::setw(22) << "" << std::setw(24) << "A" << "B"
+              << std::right << "\n";
+}
+
+template <typename T>
+static std::string field(const T &value)
+{
+    std::ostringstream out;
+    out << std::setprecision(9) << value;
+    return out.str();
+}
+
+static std::string hex(uint64_t value)
+{
+    std::ostringstream out;
+    out << std::hex << std::setw(16) << std::setfill('0') << value;
+    return out.str();
+}
+
+
+/**
+ * Both snapshots side by side, with the fields that differ starred
+ */
+static void print_diff(const WorldSnapshot &a, const WorldSnapshot &b)
+{
+    print_header();
+    print_row("tick", field(a.tick), field(b.tick));
+    print_row("run_ticks", field(a.run_ticks), field(b.run_ticks));
+    print_row("player_y", field(a.player_y), field(b.player_y));
+    print_row("player_velocity", field(a.player_velocity), field(b.player_velocity));
+    print_row("player_angle", field(a.player_angle), field(b.player_angle));
+    print_row("player_frame", field(a.player_frame), field(b.player_frame));
+    print_row("score", field(a.score), field(b.score));
+    print_row("dead", field(a.dead), field(b.dead));
+    print_row("idle", field(a.idle), field(b.idle));
+    print_row("flaps", field(a.flaps), field(b.flaps));
+    print_row("death_cause", field(a.death_cause), field(b.death_cause));
+    for (int i = 0; i < NUM_OBSTACLES; i++) {
+        std::string x = "obstacle_x[" + field(i) + "]";
+        std::string height = "obstacle_height[" + field(i) + "]";
+        print_row(x.c_str(), field(a.obstacle_x[i]), field(b.obstacle_x[i]));
+        print_row(height.c_str(), field(a.obstacle_height[i]), field(b.obstacle_height[i]));
+    }
+    print_row("ground_x_1", field(a.ground_x_1), field(b.ground_x_1));
+    print_row("ground_x_2", field(a.ground_x_2), field(b.ground_x_2));
+    print_row("rng_state", hex(a.rng_state), hex(b.rng_state));
+    print_row("state_hash", hex(a.state_hash), hex(b.state_hash));
+}
+
+
+static void describe(const char *name, const Recording &recording)
+{
+    std::cout << name << ": " << recording.path << ", seed " << recording.header.seed
+              << ", " << recording.header.step << " ms ticks, "
+              << (recording.header.flags & REPLAY_FIXED ? "fixed point" : "float")
+              << ", " << recording.end_tick << " ticks, " << recording.hashes.size()
+              << " hashes\n";
+}
+
+
+static void report_playback(const char *name, const Playback &playback)
+{
+    std::cout << "this build: " << name;
+    if (playback.recording.hashes.empty())
+        std::cout << " has no hashes to check against\n";
+    else if (!playback.mismatch)
+        std::cout << " plays back as recorded\n";
+    else if (playback.have_match)
+        std::cout << " first disagrees with its recording at tick " << playback.mismatch_tick
+                  << " (last agreed at tick " << playback.last_match << ")\n";
+    else
+        std::cout << " first disagrees with its recording at tick " << playback.mismatch_tick
+                  << ", its first hash\n";
+}
+
+
+static int compare_replays(const Recording &a, const Recording &b)
+{
+    describe("A", a);
+    describe("B", b);
+    if (a.header.seed != b.header.seed || a.header.step != b.header.step ||
+        a.header.flags != b.header.flags)
+        std::cout << "A and B were recorded with different settings\n";
+
+    bool diverged = false;
+
+    // What the two recordings say, where both hashed the same tick
+    size_t i = 0, j = 0;
+    unsigned long agreed = 0;
+    bool have_agreed = false, recorded_differ = false;
+    while (i < a.hashes.size() && j < b.hashes.size()) {
+        if (a.hashes[i].first < b.hashes[j].first) {
+            i++;
+        } else if (b.hashes[j].first < a.hashes[i].first) {
+            j++;
+        } else if (a.hashes[i].second == b.hashes[j].second) {
+            agreed = a.hashes[i].first;
+            have_agreed = true;
+            i++;
+            j++;
+        } else {
+            std::cout << "recorded hashes: first differ at tick " << a.hashes[i].first;
+            if (have_agreed)
+                std::cout << " (last agreed at tick " << agreed << ")";
+            std::cout << "\n";
+            recorded_differ = true;
+            diverged = true;
+            break;
+        }
+    }
+    if (!recorded_differ) {
+        if (have_agreed)
+            std::cout << "recorded hashes: agree through tick " << agreed << "\n";
+        else
+            std::cout << "recorded hashes: none in common\n";
+    }
+
+    // Both played back here in lockstep
+    Playback pa(a), pb(b);
+    WorldSnapshot before_a = pa.snap, before_b = pb.snap;
+    bool local_differ = false;
+    unsigned long differ_tick = 0;
+    WorldSnapshot at_a, at_b;
+
+    while (!pa.finished() || !pb.finished()) {
+        bool both = !pa.finished() && !pb.finished();
+        if (!pa.finished())
+            pa.step();
+        if (!pb.finished())
+            pb.step();
+
+        if (both && !local_differ && pa.snap.state_hash != pb.snap.state_hash) {
+            local_differ = true;
+            differ_tick = pa.tick - 1;
+            at_a = pa.snap;
+            at_b = pb.snap;
+        }
+        if (!local_differ) {
+            before_a = pa.snap;
+            before_b = pb.snap;
+        }
+    }
+
+    report_playback("A", pa);
+    report_playback("B", pb);
+    diverged = diverged || pa.mismatch || pb.mismatch;
+
+    if (local_differ) {
+        std::cout << "this build: A and B first diverge at tick " << differ_tick << "\n\n";
+        print_diff(at_a, at_b);
+        std::cout << "\nthe tick before:\n";
+        print_diff(before_a, before_b);
+        diverged = true;
+    } else {
+        std::cout << "this build: A and B play the same through tick "
+                  << std::min(a.end_tick, b.end_tick) << "\n";
+        if (recorded_differ)
+            std::cout << "with the same inputs, the builds or machines that recorded them step "
+                         "differently\n";
+    }
+
+    std::cout << std::flush;
+    return diverged ? 1 : 0;
+}
+
+
+/**
+ * Every run in a run log, by seed
+ */
+static bool load_run_log(const char *path, std::map<uint32_t, RunRecord> &runs)
+{
+    std::ifstream in(path, std::ios::binary);
+    RunLogHeader header;
+    if (!in.read((char *)&header, sizeof(header)) || memcmp(header.magic, "CFRUNLOG", 8) != 0 ||
+        header.version != RUN_LOG_VERSION || header.block_rows != RUN_LOG_BLOCK_ROWS ||
+        header.block_size != sizeof(RunBlock)) {
+        std::cerr << path << " is not a run log this build can read" << std::endl;
+        return false;
+    }
+
+    std::unique_ptr<RunBlock> block(new RunBlock);
+    while (in.read((char *)block.get(), sizeof(RunBlock))) {
+        for (uint32_t i = 0; i < block->rows && i < RUN_LOG_BLOCK_ROWS; i++) {
+            WorldSnapshot snap;
+            snap.score = block->score[i];
+            snap.run_ticks = block->death_tick[i];
+            snap.flaps = block->flaps[i];
+            snap.state_hash = block->state_hash[i];
+            snap.death_cause = (DeathCause)block->death_cause[i];
+            runs.insert(std::make_pair(block->seed[i], RunRecord(block->seed[i], snap)));
+        }
+    }
+    return true;
+}
+
+
+static int compare_run_logs(const char *path_a, const char *path_b)
+{
+    std::map<uint32_t, RunRecord> a, b;
+    if (!load_run_log(path_a, a) || !load_run_log(path_b, b))
+        return 2;
+
+    unsigned long common = 0, differ = 0;
+    const RunRecord *first_a = nullptr, *first_b = nullptr;
+    for (const auto &run : a) {
+        auto other = b.find(run.first);
+        if (other == b.end())
+            continue;
+        common++;
+        if (run.second.state_hash != other->second.state_hash) {
+            if (differ++ == 0) {
+                first_a = &run.second;
+                first_b = &other->second;
+            }
+        }
+    }
+
+    std::cout << "A: " << path_a << ", " << a.size() << " runs\n"
+              << "B: " << path_b << ", " << b.size() << " runs\n"
+              << common << " seeds in both, " << differ << " ended differently\n";
+
+    if (first_a != nullptr) {
+        std::cout << "first at seed " << first_a->seed << ":\n";
+        print_header();
+        print_row("score", field(first_a->score), field(first_b->score));
+        print_row("death_tick", field(first_a->death_tick), field(first_b->death_tick));
+        print_row("flaps", field(first_a->flaps), field(first_b->flaps));
+        print_row("death_cause", field(first_a->death_cause), field(first_b->death_cause));
+        print_row("state_hash", hex(first_a->state_hash), hex(first_b->state_hash));
+    }
+
+    std::cout << std::flush;
+    return differ > 0 ? 1 : 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " A B\n"
+                  << "  two replays, or two run logs\n";
+        return 2;
+    }
+
+    std::vector<uint8_t> data_a, data_b;
+    if (!read_file(argv[1], data_a) || !read_file(argv[2], data_b))
+        return 2;
+
+    if (data_a.size() >= 8 && memcmp(data_a.data(), "CFRUNLOG", 8) == 0)
+        return compare_run_logs(argv[1], argv[2]);
+
+    Recording a, b;
+    if (!load_recording(argv[1], data_a, a) || !load_recording(argv[2], data_b, b))
+        return 2;
+    return compare_replays(a, b);
+}
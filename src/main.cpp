@@ -5,18 +5,32 @@
 #include <chrono>
 #include <fstream>
 #include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <memory>
+#include <new>
 
 #include "SDL2/SDL.h"
 #include "SDL2/SDL_image.h"
 #include "SDL2/SDL_mixer.h"
 
 #include "sdl_util.hpp"
+#include "profiler.hpp"
+#include "telemetry.hpp"
+#include "lockfree.hpp"
+#include "game.hpp"
+#include "replay.hpp"
+#include "capture.hpp"
+#include "task_graph.hpp"
+#include "step_server.hpp"
+#include "ghosts.hpp"
+#include "run_log.hpp"
 
-#define SCREEN_WIDTH  400
-#define SCREEN_HEIGHT 360
-#define SCREEN_DEPTH  32
-
-#define SPEED 200.0f
 
 // Endianess check for SDL RGBA surfaces
 #if SDL_BYTEORDER == SDL_BIG_ENDIAN
@@ -31,632 +45,1048 @@
 #define AMASK 0xff000000
 #endif
 
+// Redraw rate for the menu, where only the wings and the tap hint move
+#define IDLE_ANIMATION_HZ 30
+
+// Frame rate of --capture recordings
+#define CAPTURE_FPS 60
+
+// How solid ghost birds are drawn, out of 255
+#define GHOST_OPACITY 80
+
 
 Mix_Chunk *g_score = nullptr;
 
-class Entity
+
+/**
+ * Builds the per-frame list of entities to draw, skipping the ones whose
+ * bounds lie outside the view. Everything scrolls horizontally, so the
+ * entities are kept sorted by the left edge of their bounds and only the
+ * slice that can overlap the view gets tested.
+ */
+class DrawList
 {
     public:
-        Entity()
-        {
-            id = generate_id();
-        }
 
-        virtual void update(int delta) = 0;
-        virtual void draw(SDL_Renderer *renderer) = 0;
-        virtual void on_collision(Entity *ent) {};
+        DrawList() : culled(0), max_width(0) {}
 
-        bool operator==(const Entity &ent) const
+        void register_entity(Entity *entity)
         {
-            return (id == ent.get_id());
+            index.push_back({entity->get_bounds().x, (int)index.size(), entity});
         }
 
-        std::vector<SDL_Rect> get_collision_rects()
+        /**
+         * Rebuild the visible list for this frame
+         * @param view The visible area in screen coordinates
+         */
+        void build(SDL_Rect view)
         {
-            return collision_rects;
-        }
+            visible.clear();
+            max_width = 0;
 
-        const int get_id() const
-        {
-            return id;
-        }
+            for (Item &item : index) {
+                SDL_Rect bounds = item.entity->get_bounds();
+                item.x = bounds.x;
+                max_width = std::max(max_width, bounds.w);
+            }
 
-    protected:
-        int id;
-        SDL_Texture *texture;
-        double angle;
-        std::vector<SDL_Rect> collision_rects;
+            /* Positions only drift a little per frame, so the index is
+             * nearly sorted and insertion sort runs in about linear time. */
+            for (size_t i = 1; i < index.size(); i++) {
+                Item item = index[i];
+                size_t j = i;
+                while (j > 0 && index[j - 1].x > item.x) {
+                    index[j] = index[j - 1];
+                    j--;
+                }
+                index[j] = item;
+            }
 
-    private:
-        int generate_id()
-        {
-            static int s_nid = 0;
-            return s_nid++;
-        } 
-};
+            Item key = { view.x - max_width, 0, nullptr };
+            std::vector<Item>::iterator it = std::lower_bound(
+                    index.begin(), index.end(), key,
+                    [](const Item &a, const Item &b) { return a.x < b.x; });
 
+            for (; it != index.end() && it->x < view.x + view.w; it++) {
+                if (CollisionBank::check_collision(it->entity->get_bounds(), view))
+                    visible.push_back(*it);
+            }
 
-class CollisionBank
-{
-    public:
+            /* Draw in registration order, not in x order */
+            std::sort(visible.begin(), visible.end(),
+                      [](const Item &a, const Item &b) { return a.order < b.order; });
 
-        void register_entity(Entity *entity)
-        {
-            entities.push_back(entity);
+            culled = index.size() - visible.size();
         }
 
-        void dispatch_collisions()
+        void draw(SDL_Renderer *renderer)
         {
-            /* N^2 does it matter for small amount of entities? */
-            for (Entity * entity_a : entities) {
-                for (Entity * entity_b : entities) {
-                    if (*entity_a == *entity_b)
-                        continue;
-
-                    for(SDL_Rect rect_a : entity_a->get_collision_rects()) {
-                        for(SDL_Rect rect_b : entity_b->get_collision_rects()) {
-                            if (check_collision(rect_a, rect_b)) {
-                                entity_b->on_collision(entity_a);
-                                entity_a->on_collision(entity_b);
-                            }
-                        }
-                    }
-                }
-            }
+            for (Item &item : visible)
+                item.entity->draw(renderer);
         }
 
-        
-        static bool check_collision(SDL_Rect A, SDL_Rect B) {
-            // The sides of the rectangles
-            int leftA, leftB;
-            int rightA, rightB;
-            int topA, topB;
-            int bottomA, bottomB;
-
-            // Calculate the sides of rect A
-            leftA = A.x;
-            rightA = A.x + A.w;
-            topA = A.y;
-            bottomA = A.y + A.h;
-
-            // Calculate the sides of rect B
-            leftB = B.x;
-            rightB = B.x + B.w;
-            topB = B.y;
-            bottomB = B.y + B.h; 
-                
-            // If any of the sides from A are outside of B
-            if(bottomA <= topB) {
-                return false;
-            }
-            if(topA >= bottomB) {
-               return false;
-            }
-            if(rightA <= leftB) {
-               return false;
-            }
-            if(leftA >= rightB) {
-                return false;
-            }
-
-            // If none of the sides from A are outside B
-            return true;
-        } 
+        size_t get_drawn() const
+        {
+            return visible.size();
+        }
 
-        static  bool check_point_collision(int x, int y, SDL_Rect rect)
+        size_t get_culled() const
         {
-            if (x >= rect.x && x <= (rect.x + rect.w) &&
-                y >= rect.y && y <= (rect.y + rect.h))
-                return true;
-            else
-                return false;
+            return culled;
         }
 
     private:
-        std::vector<Entity*> entities;
+        struct Item {
+            int x;
+            int order;
+            Entity *entity;
+        };
+
+        std::vector<Item> index;
+        std::vector<Item> visible;
+        size_t culled;
+        int max_width;
 };
 
 
-class FlappyFuch :public Entity
+
+/*
+ * Count every allocation for the telemetry, so a steady frame can be seen
+ * to make none
+ */
+void *operator new(std::size_t size)
 {
-    public:
-        
-        FlappyFuch(int x, int y) :Entity(), x(x), y(y)
-        {
+    sp::Telemetry::count(sp::Telemetry::ALLOCATIONS);
+    void *p = std::malloc(size ? size : 1);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
 
-            frames[0] = {
-                .x = 264,
-                .y = 64,
-                .w = 17,
-                .h = 12
-            };
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
 
-            frames[1] = {
-                .x = 264,
-                .y = 90,
-                .w = 17,
-                .h = 12
-            };
 
-            frames[2] = {
-                .x = 223,
-                .y = 124,
-                .w = 17,
-                .h = 12
-            };
+static double now_seconds()
+{
+    using namespace std::chrono;
+    return duration_cast<duration<double>>(steady_clock::now().time_since_epoch()).count();
+}
 
-            frames[3] = frames[1];
 
-            current_frame = 0;
+/**
+ * The latest two snapshots the simulation produced, so the renderer can
+ * interpolate between them.
+ */
+struct SimFrame
+{
+    WorldSnapshot prev, curr;
+};
 
-            threshold = 0.0f;
-            next_frame = 0;
-            last_tick = 0;
-            y_v = 30;
-            angle = 0;
 
-            dead = false;
-            score_queued = false;
-            score_count = 0;
-            idle = false;
+/**
+ * Steps a World at a fixed rate on its own thread. Input goes in through
+ * a wait-free queue and snapshots come out through a triple buffer, so a
+ * slow present never holds up physics and the other way around.
+ *
+ * Inputs can be recorded to a replay as they are applied, or taken from a
+ * replay instead of the queue. Without start() the world can also be
+ * stepped on the caller's thread with advance(), for running headless.
+ */
+class Simulation
+{
+    public:
 
-            set_collision();
+        Simulation(unsigned seed, int step, bool fixed)
+            : step(std::max(1, step)), running(false), ticks(0), settled(false),
+              replay(nullptr), recorder(nullptr), replay_done(false),
+              seed(seed), run_log(nullptr),
+              wakeups(0)
+        {
+            if (fixed)
+                world.reset(new FixedWorld(seed));
+            else
+                world.reset(new World(seed));
+
+            SimFrame &frame = frames.write_buffer();
+            world->snapshot(frame.curr);
+            frame.curr.time = now_seconds();
+            frame.prev = frame.curr;
+            prev = frame.curr;
+            frames.publish();
+            frames.update();
         }
 
-        void flap()
+        ~Simulation()
         {
-            if (!dead && !idle)
-                y_v = -265;
+            stop();
         }
 
-        SDL_Rect get_dest()
+        /**
+         * Take inputs from a replay instead of the input queue
+         */
+        void set_replay(ReplayReader *replay)
         {
-            return collision_rects[0];
+            this->replay = replay;
         }
 
-        void set_collision()
+        /**
+         * Write every input applied from now on into a replay
+         */
+        void set_recorder(ReplayWriter *recorder)
         {
-            if (!collision_rects.empty())
-                collision_rects.pop_back();
-            collision_rects.push_back({
-                .x = (int)x,
-                .y = (int)y,
-                .w = 38,
-                .h = 24
-            });
+            this->recorder = recorder;
         }
 
-        void draw(SDL_Renderer *renderer)
+        /**
+         * Log every run that ends from now on. The buffer is filled from
+         * the simulation thread and flushed by stop().
+         */
+        void set_run_log(RunLogBuffer *run_log)
         {
-            if (texture) {
-                sp::render_texture(renderer, texture, get_dest(),
-                                   &frames[current_frame], angle);
-            }
+            this->run_log = run_log;
         }
 
-        void update(int delta)
+        void start()
         {
-            if (score_queued && !in_collision && !idle && !dead) {
-                score_count++;
-                score_queued = false;
-                if (Mix_PlayChannel(-1, g_score, 0) == -1 ) {
-                    std::cerr << "Mix_PlayChannel: " << Mix_GetError() << std::endl;
-                }
-            }
-
-            int acceleration = 920;
-            float t = (delta / 1000.0f);
-            
-            if (dead)
-                acceleration = 5000;
-
-            if (!idle) {
-                y += y_v * t;
-                y_v += acceleration * t;
-                if (y <= 0.0f)
-                    y = 0.0f;
-            }
-
-            if (y >= SCREEN_HEIGHT - frames[current_frame].h - 10 - 60) {
-                die();
-                y = SCREEN_HEIGHT - frames[current_frame].w - 10 - 60;
-                if (angle < 90)
-                    angle += (90 - angle) * t * 52;
-                else
-                    angle = 90;
-            } else if (!idle) {
-                angle += ((y_v / 10.0) - angle) * t * 15;
-                if (angle >= 360 || angle <= -360)
-                    angle = 0;
-            }
-
-            if (!dead) {
-                if (next_frame >= 60) {
-                    current_frame = (current_frame + 1) % 4;
-                    next_frame = 0;
-                }
-                next_frame += delta;
-            } else {
-                current_frame = 0;
-            }
-
-            set_collision();
-
-            in_collision = false;
+            running = true;
+            thread = std::thread(&Simulation::run, this);
         }
 
-        void set_texture(SDL_Texture *texture)
+        void stop()
         {
-            this->texture = texture;
+            {
+                std::lock_guard<std::mutex> lock(wake_mutex);
+                running = false;
+            }
+            wake.notify_one();
+            if (thread.joinable())
+                thread.join();
+
+            if (recorder != nullptr && recorder->is_open())
+                recorder->finish(ticks);
+            if (run_log != nullptr)
+                run_log->flush();
         }
 
-        void set_idle()
+        /**
+         * Step the world on the calling thread, for when start() wasn't
+         * called
+         * @param n How many ticks to step
+         */
+        void advance(unsigned long n)
         {
-            idle = true;
+            while (n--)
+                tick();
         }
 
-        void set_active()
+        bool send(InputType input)
         {
-            idle = false;
+            if (!inputs.push(QueuedInput { input, sp::Telemetry::now() }))
+                return false;
+
+            /* Taking the lock orders the push before the sleeper's check of
+             * the queue: either it sees the input or it's already waiting
+             * and gets the notify. Inputs come a few a second, so the lock
+             * costs nothing next to a missed wakeup. */
+            {
+                std::lock_guard<std::mutex> lock(wake_mutex);
+            }
+            wake.notify_one();
+            return true;
         }
 
-        bool is_idle()
+        /**
+         * Pick up the newest frame from the simulation thread
+         * @return true if there was a new one
+         */
+        bool update()
         {
-            return idle;
+            return frames.update();
         }
 
-        void die()
+        const SimFrame &latest() const
         {
-            dead = true;
+            return frames.read_buffer();
         }
 
-        void on_collision(Entity *ent1)
+        /**
+         * The length of one tick in milliseconds
+         */
+        int get_step() const
         {
-            in_collision = true;                
+            return step;
         }
 
-        void score()
+        unsigned long get_ticks() const
         {
-            score_queued = true;
+            return ticks;
         }
 
-        int get_score()
+        /**
+         * Whether the replay being played back has run out
+         */
+        bool is_replay_done() const
         {
-            return score_count;
+            return replay_done;
         }
 
-        bool is_dead()
+        /**
+         * How many times the simulation thread has woken up so far
+         */
+        unsigned long get_wakeups() const
         {
-            return dead;
+            return wakeups;
         }
 
-        void set_alive()
+    private:
+        void run()
         {
-            dead = false;
-            score_count = 0;
-            in_collision = false;
-            score_queued = false;
-            angle = 0;
+            using namespace std::chrono;
+
+            steady_clock::time_point next = steady_clock::now();
+
+            while (running) {
+                wakeups++;
+
+                /* On the menu, and once a dead bird has come to rest,
+                 * there's nothing to step until some input comes in */
+                if (settled && replay == nullptr) {
+                    std::unique_lock<std::mutex> lock(wake_mutex);
+                    wake.wait(lock, [this] { return !running || !inputs.empty(); });
+                    next = steady_clock::now();
+                    if (!running)
+                        break;
+                }
+
+                tick();
+
+                /* Don't try to catch up on a long stall, just carry on */
+                next += milliseconds(step);
+                if (steady_clock::now() - next > milliseconds(250))
+                    next = steady_clock::now();
+
+                std::this_thread::sleep_until(next);
+            }
         }
 
-        void set_y(int y)
+        void tick()
         {
-            this->y = y;
-            set_collision();
-        }
+            uint64_t start = sp::Telemetry::now();
 
-    private:
-        SDL_Rect frames[4];
-        int current_frame;
-        float x, y, y_v;
-        int next_frame, last_tick;
-        int score_count;
-        float threshold;
-        bool dead, score_queued, in_collision;
-        bool idle;
-};
+            if (replay != nullptr) {
+                InputType input;
+                while (replay->poll(ticks, input))
+                    apply(input);
+                replay_done = replay->finished(ticks);
+            } else {
+                QueuedInput queued;
+                while (inputs.pop(queued)) {
+                    apply(queued.input);
+                    sp::Telemetry::record(sp::Telemetry::INPUT_LATENCY, start - queued.sent);
+                    if (recorder != nullptr)
+                        recorder->record(ticks, queued.input);
+                }
+            }
 
+            world->step(step);
+            ticks++;
+
+            SimFrame &frame = frames.write_buffer();
+            frame.prev = prev;
+            world->snapshot(frame.curr);
+            frame.curr.time = now_seconds();
+            bool died = frame.curr.dead && !prev.dead;
+            if (died) {
+                if (recorder != nullptr)
+                    recorder->record_death(ticks - 1);
+                if (run_log != nullptr)
+                    run_log->add(RunRecord(seed, frame.curr));
+            }
+            if (recorder != nullptr && (died || ticks % REPLAY_HASH_INTERVAL == 0))
+                recorder->record_hash(ticks - 1, frame.curr.state_hash);
+            settled = frame.curr.idle || (frame.curr.dead && same_state(prev, frame.curr));
+            prev = frame.curr;
+            frames.publish();
 
-class Obstacle :public Entity
-{
-    public:
-        
-        Obstacle(float x, float y, int begin, int end, int gap)
-            : Entity(), begin(begin), end(end), gap(gap)
+            sp::Telemetry::record(sp::Telemetry::SIMULATE_TIME, sp::Telemetry::now() - start);
+        }
+
+        void apply(InputType input)
         {
+            if (input == INPUT_FLAP)
+                world->flap();
+            else
+                world->reset();
+        }
 
-            last_tick = 0;
-            this->x = x;
-            this->y = y;
+        /* An input and when it was sent, to time how long it waits */
+        struct QueuedInput
+        {
+            InputType input;
+            uint64_t sent;
+        };
 
-            clip_pipe_top_body = {
-                .x = 303,
-                .y = 0,
-                .w = 24,
-                .h = 1
-            };
+        std::unique_ptr<WorldBase> world;
+        sp::SpscQueue<QueuedInput, 64> inputs;
+        sp::TripleBuffer<SimFrame> frames;
+        int step;
+        std::atomic<bool> running;
+        std::thread thread;
 
-            clip_pipe_top = {
-                .x = 302,
-                .y = 123,
-                .w = 26,
-                .h = 12
-            };
+        std::atomic<unsigned long> ticks;
+        WorldSnapshot prev;
+        // Nothing changes until the next input: on the menu, or dead and at rest
+        bool settled;
 
-            dest_pipe_top = {
-                .x = (int)x,
-                .y = (int)y - begin,
-                .w = 26 * 2,
-                .h = 12 * 2
-            };
+        ReplayReader *replay;
+        ReplayWriter *recorder;
+        std::atomic<bool> replay_done;
 
-            dest_pipe_top_body = {
-                .x = (int)x + 2,
-                .y = begin,
-                .w = 24 * 2,
-                .h = (int)y - begin
-            };
+        unsigned seed;
+        RunLogBuffer *run_log;
 
-            clip_pipe_bottom_body = {
-                .x = 331,
-                .y = 12,
-                .w = 24,
-                .h = 1
-            };
+        std::mutex wake_mutex;
+        std::condition_variable wake;
+        std::atomic<unsigned long> wakeups;
+};
 
-            clip_pipe_bottom = {
-                .x = 330,
-                .y = 0,
-                .w = 26,
-                .h = 12
-            };
 
-            dest_pipe_bottom = {
-                .x = (int)x,
-                .y = begin + gap + (int)y + 12 * 2,
-                .w = 26 * 2,
-                .h = 12 * 2
-            };
+/**
+ * Move the render-side entities to where a snapshot says they are
+ */
+static void apply_snapshot(const WorldSnapshot &snap, FlappyFuch &player,
+                           std::vector<Obstacle> &obstacles)
+{
+    player.set_pose(snap.player_y, snap.player_angle, snap.player_frame);
 
-            dest_pipe_bottom_body = {
-                .x = (int)x + 2,
-                .y = begin + gap + (int)y + 12 * 4,
-                .w = 24 * 2,
-                .h = end - (begin + gap + (int)y + 12 * 4)
-            };
+    for (int i = 0; i < NUM_OBSTACLES; i++) {
+        if (obstacles[i].get_height() != snap.obstacle_height[i])
+            obstacles[i].set_height(snap.obstacle_height[i]);
+        obstacles[i].set_x(snap.obstacle_x[i]);
+    }
+}
 
-        }
 
-        void draw(SDL_Renderer *renderer)
-        {
-            if (texture) {
-                sp::render_texture(renderer, texture, dest_pipe_top_body, &clip_pipe_top_body);
-                sp::render_texture(renderer, texture, dest_pipe_top, &clip_pipe_top);
+/**
+ * Everything that decides what a frame looks like, in whole pixels. If two
+ * frames have the same key they would draw the same picture.
+ */
+struct RenderKey
+{
+    int player_y, player_angle, player_frame;
+    int obstacle_x[NUM_OBSTACLES];
+    int obstacle_height[NUM_OBSTACLES];
+    int ground_x_1, ground_x_2;
+    int score, dead, idle;
+    int tap_y, ok_y, best_score;
+
+    bool operator==(const RenderKey &key) const
+    {
+        return memcmp(this, &key, sizeof(key)) == 0;
+    }
+};
 
-                sp::render_texture(renderer, texture, dest_pipe_top_body, &clip_pipe_bottom_body);
-                sp::render_texture(renderer, texture, dest_pipe_top, &clip_pipe_bottom);
 
-                sp::render_texture(renderer, texture, dest_pipe_bottom_body, &clip_pipe_bottom_body);
-                sp::render_texture(renderer, texture, dest_pipe_bottom, &clip_pipe_bottom);
+static RenderKey make_render_key(const WorldSnapshot &snap, int tap_y,
+                                 int ok_y, int best_score)
+{
+    RenderKey key;
 
-                sp::render_texture(renderer, texture, dest_pipe_bottom_body, &clip_pipe_bottom_body);
-                sp::render_texture(renderer, texture, dest_pipe_bottom, &clip_pipe_bottom);
-            }
-        }
+    key.player_y = snap.player_y;
+    key.player_angle = snap.player_angle;
+    key.player_frame = snap.player_frame;
 
-        void update(int delta)
-        {
-            set_x(x - SPEED * (delta / 1000.0f));
-        }
+    for (int i = 0; i < NUM_OBSTACLES; i++) {
+        key.obstacle_x[i] = snap.obstacle_x[i];
+        key.obstacle_height[i] = snap.obstacle_height[i];
+    }
 
-        void set_x(float x)
-        {
-            this->x = x;
+    key.ground_x_1 = snap.ground_x_1;
+    key.ground_x_2 = snap.ground_x_2;
+    key.score = snap.score;
+    key.dead = snap.dead;
+    key.idle = snap.idle;
+    key.tap_y = tap_y;
+    key.ok_y = ok_y;
+    key.best_score = best_score;
 
-            dest_pipe_top.x = (int)x;
-            dest_pipe_top_body.x = (int)x + 2;
+    return key;
+}
 
-            dest_pipe_bottom.x = (int)x;
-            dest_pipe_bottom_body.x = (int)x + 2;
 
-            set_collision_rects();
+/**
+ * Run the float and fixed point physics side by side on the same seed and
+ * the same scripted flaps, and check the bird and pipes stay within a
+ * small distance of each other until the bird dies, and then while both
+ * lie dead for a long time.
+ * @return 0 if the two paths agree
+ */
+static int check_physics(unsigned seed, int step)
+{
+    World world(seed);
+    FixedWorld fixed_world(seed);
+
+    WorldSnapshot a, b;
+    float worst = 0.0f;
+    bool heights_agree = true;
+    unsigned long tick;
+
+    for (tick = 0; tick < 60000 / step; tick++) {
+        // Both worlds get the same input, decided from the float one
+        world.snapshot(a);
+        if (tick == 0 || autopilot(a)) {
+            world.flap();
+            fixed_world.flap();
         }
-        
-        void set_collision_rects()
-        {
-            if (!collision_rects.empty())
-                collision_rects.clear();
-
-            collision_rects.push_back(dest_pipe_top);
-            collision_rects.push_back(dest_pipe_top_body);
-            collision_rects.push_back(dest_pipe_bottom);
-            collision_rects.push_back(dest_pipe_bottom_body);
-
-            SDL_Rect score_rect = {
-                dest_pipe_top.x,
-                dest_pipe_top.y + dest_pipe_top.h,
-                1,
-                dest_pipe_bottom.y - dest_pipe_top.y + dest_pipe_top.h
-            };
-            
-            collision_rects.push_back(score_rect);
+
+        world.step(step);
+        fixed_world.step(step);
+        world.snapshot(a);
+        fixed_world.snapshot(b);
+
+        worst = std::max(worst, std::fabs(a.player_y - b.player_y));
+
+        // A pipe right at the left edge can be recycled a tick sooner in
+        // one world than the other. For that tick it's a whole lap of pipes
+        // ahead, so it's compared with where the other world is about to
+        // put it, and its new height isn't compared until both have it.
+        const float lap = NUM_OBSTACLES * ArcadeRules::pipe_spacing;
+        for (int i = 0; i < NUM_OBSTACLES; i++) {
+            float dx = a.obstacle_x[i] - b.obstacle_x[i];
+            float laps = std::round(dx / lap);
+            worst = std::max(worst, std::fabs(dx - laps * lap));
+            if (std::fabs(laps) > 1 ||
+                (laps == 0 && a.obstacle_height[i] != b.obstacle_height[i]))
+                heights_agree = false;
         }
 
-        void set_height(int y)
-        {
-            this->y = y;
+        if (a.dead || b.dead)
+            break;
+    }
 
-            dest_pipe_top.y = y - begin;
-            dest_pipe_top_body.h = y - begin;
+    // A dead bird is still stepped (a step server session nobody resets, a
+    // ghost that has finished), so keep both going for ten minutes of game
+    // time and check they stay on the ground together
+    unsigned long after;
+    float worst_dead = 0.0f;
+    for (after = 0; a.dead && b.dead && after < 600000 / step; after++) {
+        world.step(step);
+        fixed_world.step(step);
+        world.snapshot(a);
+        fixed_world.snapshot(b);
+        worst_dead = std::max(worst_dead, std::fabs(a.player_y - b.player_y));
+    }
 
-            dest_pipe_bottom.y = begin + gap + y + 12 * 2;
-            dest_pipe_bottom_body.y = begin + gap + y + 12 * 4;
-            dest_pipe_bottom_body.h = end - (begin + gap + y + 12 * 4);
+    bool agree = a.dead == b.dead && a.score == b.score && heights_agree &&
+                 worst <= 1.0f && worst_dead <= 1.0f;
 
-            set_collision_rects();
-        }
+    std::cout << "ticks " << tick << " score " << a.score << "/" << b.score
+              << " max deviation " << worst << "px, then " << after
+              << " ticks dead " << worst_dead << "px "
+              << (agree ? "ok" : "MISMATCH") << std::endl;
 
-        void on_collision(Entity *entity)
-        {
-            try {
-                FlappyFuch *player = dynamic_cast<FlappyFuch*>(entity);
-                if (player != nullptr) {
-                    std::vector<SDL_Rect> player_rects = player->get_collision_rects();
-                    for(std::vector<SDL_Rect>::iterator it =
-                         collision_rects.begin(); it < collision_rects.end() - 1; it++) {
-
-                        if (CollisionBank::check_collision(*it, player_rects[0])) {
-                            player->die(); 
-                            return;
-                        }
-                    }
-                    
-                    player->score();
-                }
-            } catch(std::bad_cast) {
-            }
-        }
-
-        void set_texture(SDL_Texture *texture)
-        {
-            this->texture = texture;
-        }
+    return agree ? 0 : 1;
+}
 
-        int get_width()
-        {
-            return dest_pipe_top.w;
-        }
 
-        int get_x()
-        {
-            return x;
+/**
+ * Record a corpus of runs for the ghost race. Every run is on the same
+ * pipes, flown by the autopilot with the odd wrong decision thrown in so
+ * that no two go quite the same way.
+ * @return Process exit code
+ */
+static int make_ghosts(const char *path, unsigned seed, int step, int count)
+{
+    for (int run = 0; run < count; run++) {
+        ReplayWriter writer;
+        if (!writer.open(path, seed, step, 0, run > 0)) {
+            std::cerr << "Failed to open " << path << std::endl;
+            return 1;
         }
 
-    private:
+        World world(seed);
+        Random noise(run + 1);
+        WorldSnapshot snap;
+        unsigned long tick, died = 0;
+
+        for (tick = 0; tick < 120000 / step; tick++) {
+            world.snapshot(snap);
+            if (snap.dead && tick - died >= 500 / step)
+                break;
+
+            bool flap = autopilot(snap);
+            if (noise.range(0, 99) < 4)
+                flap = !flap;
+            if (tick == 0 || (flap && !snap.dead)) {
+                world.flap();
+                writer.record(tick, INPUT_FLAP);
+            }
 
-        SDL_Rect clip_pipe_top_body;
-        SDL_Rect clip_pipe_top;
+            world.step(step);
+            world.snapshot(snap);
+            bool just_died = snap.dead && died == 0;
+            if (just_died) {
+                writer.record_death(tick);
+                died = tick;
+            }
+            if (just_died || (tick + 1) % REPLAY_HASH_INTERVAL == 0)
+                writer.record_hash(tick, snap.state_hash);
+        }
 
-        SDL_Rect dest_pipe_top_body;
-        SDL_Rect dest_pipe_top;
+        writer.record(tick, INPUT_RESET);
+        writer.finish(tick);
+    }
 
-        SDL_Rect clip_pipe_bottom_body;
-        SDL_Rect clip_pipe_bottom;
+    std::cout << "Wrote " << count << " runs with seed " << seed << " to " << path
+              << std::endl;
+    return 0;
+}
 
-        SDL_Rect dest_pipe_bottom_body;
-        SDL_Rect dest_pipe_bottom;
 
-        int begin, end, gap;
-        int last_tick;
-        float x, y;
-};
+/**
+ * Play games headless as fast as the cores allow and log how each went.
+ * Run i is on seed + i, flown by the autopilot with noise in a thousand
+ * of its decisions flipped, and ends when the bird dies or after two
+ * minutes of game time.
+ * @return Process exit code
+ */
+static int sweep(RunLog &log, unsigned seed, int step, int runs, int noise)
+{
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    double start = now_seconds();
+
+    auto play = [&](int first) {
+        RunLogBuffer buffer(log);
+        WorldSnapshot snap;
+
+        for (int run = first; run < runs; run += threads) {
+            uint32_t run_seed = seed + run;
+            World world(run_seed);
+            // A stream of its own: seeded with run_seed it would be the
+            // world's pipe heights, and the flips would follow the pipes.
+            // The high word keeps it off every 32 bit world seed.
+            Random flips((uint64_t)run_seed ^ 0x6E6F697365000000ull);
+
+            for (unsigned long tick = 0; tick < 120000 / step; tick++) {
+                world.snapshot(snap);
+                if (snap.dead)
+                    break;
 
+                bool flap = autopilot(snap);
+                if (flips.range(0, 999) < noise)
+                    flap = !flap;
+                if (tick == 0 || flap)
+                    world.flap();
 
-static std::vector<int> digit_to_array(int digit)
-{
-    std::vector<int> result;
-    std::vector<int>::iterator it;
+                world.step(step);
+            }
 
-    while (digit) {
-        it = result.begin();
-        result.insert(it, digit % 10);
-        digit /= 10;
-    }
+            world.snapshot(snap);
+            buffer.add(RunRecord(run_seed, snap));
+        }
+    };
 
-    return result;
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++)
+        workers.push_back(std::thread(play, i));
+    for (std::thread &worker : workers)
+        worker.join();
+    log.close();
+
+    double seconds = now_seconds() - start;
+    std::cout << "Logged " << log.get_rows() << " runs in " << seconds << " s ("
+              << (unsigned long)(log.get_rows() / seconds) << " runs/s) on "
+              << threads << " threads" << std::endl;
+    return 0;
 }
 
+
 int main(int argc, char *argv[]) {
 
-    unsigned long ticks = 0, delta = 0;
-    unsigned long last_tick = SDL_GetTicks(); 
+    double process_start = now_seconds();
+    unsigned long last_tick = SDL_GetTicks();
 
     bool quit = false;
     bool lock_flap = false;
     SDL_Event event;
 
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) == -1) {
-        std::cerr << SDL_GetError() << std::endl;
-        SDL_Quit();
+    int sim_hz = 100;
+    int render_hz = 0;
+    bool profile = false;
+    bool fixed = false;
+    bool headless = false;
+    const char *record_path = nullptr;
+    const char *replay_path = nullptr;
+    const char *capture_path = nullptr;
+    const char *serve_path = nullptr;
+    const char *ghosts_path = nullptr;
+    const char *make_ghosts_path = nullptr;
+    int ghost_count = 10000;
+    const char *shm_name = nullptr;
+    int shm_sessions = 1024;
+    bool shm_pixels = false;
+    const char *stats_name = nullptr;
+    const char *run_log_path = nullptr;
+    int sweep_runs = 0;
+    int sweep_noise = 2;
+    bool have_seed = false;
+    unsigned fixed_seed = 0;
+    bool physics_check = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--sim-hz") && i + 1 < argc) {
+            sim_hz = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--render-hz") && i + 1 < argc) {
+            render_hz = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--profile")) {
+            profile = true;
+        } else if (!strcmp(argv[i], "--fixed")) {
+            fixed = true;
+        } else if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (!strcmp(argv[i], "--capture") && i + 1 < argc) {
+            capture_path = argv[++i];
+        } else if (!strcmp(argv[i], "--headless")) {
+            headless = true;
+        } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+            serve_path = argv[++i];
+        } else if (!strcmp(argv[i], "--ghosts") && i + 1 < argc) {
+            ghosts_path = argv[++i];
+        } else if (!strcmp(argv[i], "--make-ghosts") && i + 1 < argc) {
+            make_ghosts_path = argv[++i];
+        } else if (!strcmp(argv[i], "--ghost-count") && i + 1 < argc) {
+            ghost_count = std::max(0, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--serve-shm") && i + 1 < argc) {
+            shm_name = argv[++i];
+        } else if (!strcmp(argv[i], "--shm-sessions") && i + 1 < argc) {
+            shm_sessions = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--shm-pixels")) {
+            shm_pixels = true;
+        } else if (!strcmp(argv[i], "--stats") && i + 1 < argc) {
+            stats_name = argv[++i];
+        } else if (!strcmp(argv[i], "--run-log") && i + 1 < argc) {
+            run_log_path = argv[++i];
+        } else if (!strcmp(argv[i], "--sweep") && i + 1 < argc) {
+            sweep_runs = std::max(0, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--sweep-noise") && i + 1 < argc) {
+            sweep_noise = std::max(0, std::min(1000, atoi(argv[++i])));
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            fixed_seed = strtoul(argv[++i], nullptr, 10);
+            have_seed = true;
+        } else if (!strcmp(argv[i], "--check-physics")) {
+            physics_check = true;
+        } else {
+            std::cerr << "usage: " << argv[0]
+                      << " [--sim-hz N] [--render-hz N] [--profile] [--fixed]"
+                         " [--check-physics] [--record FILE] [--replay FILE]"
+                         " [--capture FILE.y4m|PATTERN] [--headless]"
+                         " [--serve SOCKET] [--serve-shm NAME] [--shm-sessions N] [--shm-pixels]"
+                         " [--ghosts FILE] [--make-ghosts FILE] [--ghost-count N]"
+                         " [--stats NAME] [--run-log FILE] [--sweep N] [--sweep-noise N]"
+                         " [--seed N]\n";
+            return 1;
+        }
+    }
+
+    // Ticks are whole milliseconds everywhere (replays, ghosts, the step
+    // servers), so only a rate with a whole millisecond step is the rate
+    // it says it is
+    if (sim_hz < 1 || 1000 % sim_hz != 0) {
+        std::cerr << "--sim-hz has to divide 1000, like 50, 100, 125, 200 or 250" << std::endl;
         return 1;
     }
 
-    int audio_rate = 22050;
-    Uint16 audio_format = AUDIO_S16SYS;
-    int audio_channels = 2;
-    int audio_buffers = 4096;
+    // Publish before anything else starts a thread that counts
+    if (stats_name != nullptr) {
+        if (!sp::Telemetry::publish(stats_name))
+            return 1;
+        std::atexit(sp::Telemetry::unpublish);
+    }
+
+    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+    if (have_seed)
+        seed = fixed_seed;
+    int step = 1000 / sim_hz;
+
+    if (physics_check) {
+        int result = 0;
+        for (unsigned seed = 1; seed <= 16; seed++)
+            result |= check_physics(seed, step);
+        return result;
+    }
 
-    // Initialize SDL_mixer
-    if(Mix_OpenAudio(audio_rate, audio_format, audio_channels, audio_buffers) == -1) {
-        printf("SDL_mixer could not initialize! SDL_mixer Error: %s\n", Mix_GetError());
-        SDL_Quit();
-        return 1;
+    if (serve_path != nullptr) {
+        StepServer server(serve_path, step, fixed);
+        return server.run();
     }
 
-    SDL_Window *win = nullptr;
-    win = SDL_CreateWindow("Crappy Bird", SDL_WINDOWPOS_CENTERED,
-                           SDL_WINDOWPOS_CENTERED, SCREEN_WIDTH,
-                           SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
+    if (shm_name != nullptr) {
+        ShmStepServer server(shm_name, shm_sessions, step, fixed, shm_pixels);
+        return server.run();
+    }
+
+    if (make_ghosts_path != nullptr)
+        return make_ghosts(make_ghosts_path, seed, step, ghost_count);
 
-    if (win == nullptr) {
-        std::cerr << SDL_GetError() << std::endl;
+    RunLog run_log(2 * std::max(2u, std::thread::hardware_concurrency()));
+    if (run_log_path != nullptr && !run_log.open(run_log_path))
         return 1;
 
+    if (sweep_runs > 0) {
+        if (run_log_path == nullptr) {
+            std::cerr << "--sweep needs --run-log" << std::endl;
+            return 1;
+        }
+        return sweep(run_log, seed, step, sweep_runs, sweep_noise);
     }
 
-    SDL_Renderer *renderer = nullptr;
-    renderer = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED |
-                                           SDL_RENDERER_PRESENTVSYNC);
+    ReplayReader replay;
+    if (replay_path != nullptr) {
+        if (!replay.open(replay_path)) {
+            std::cerr << "Failed to read replay " << replay_path << std::endl;
+            return 1;
+        }
+        seed = replay.get_header().seed;
+        step = replay.get_header().step;
+        fixed = replay.get_header().flags & REPLAY_FIXED;
+    }
 
-    if (renderer == nullptr) {
-        std::cerr << SDL_GetError() << std::endl;
-        return 1;
+    // Race on the ghosts' pipes, unless a replay has already picked them
+    GhostRace ghosts;
+    if (ghosts_path != nullptr) {
+        if (!ghosts.open(ghosts_path))
+            return 1;
+        if (replay_path == nullptr) {
+            seed = ghosts.get_first_header().seed;
+            step = ghosts.get_first_header().step;
+            fixed = ghosts.get_first_header().flags & REPLAY_FIXED;
+        }
+        std::cout << "Racing " << ghosts.load(seed, step, ghost_count)
+                  << " ghosts" << std::endl;
     }
 
-    g_score = Mix_LoadWAV("data/score.wav");
-    if(g_score == NULL) {
-        printf("Failed to load scratch sound effect! SDL_mixer Error: %s\n", Mix_GetError());
-        SDL_Quit();
+    ReplayWriter recorder;
+    if (record_path != nullptr &&
+        !recorder.open(record_path, seed, step, fixed ? REPLAY_FIXED : 0)) {
+        std::cerr << "Failed to open " << record_path << std::endl;
         return 1;
     }
 
-    SDL_Surface *jpg = IMG_Load("data/spritesheet.png");
-    if (jpg == nullptr) {
-        std::cerr << IMG_GetError() << std::endl;
-        return 1;
+    // Headless only makes sense when something else is doing the playing
+    if (headless) {
+        if (replay_path == nullptr) {
+            std::cerr << "--headless needs --replay" << std::endl;
+            return 1;
+        }
+        SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+        SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
     }
-    SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, jpg);
-    SDL_FreeSurface(jpg);
-    if (tex == nullptr) {
-        std::cerr << SDL_GetError() << std::endl;
+
+    // Recordings need every frame at a steady rate
+    if (capture_path != nullptr && render_hz <= 0)
+        render_hz = CAPTURE_FPS;
+
+    SDL_Window *win = nullptr;
+    SDL_Renderer *renderer = nullptr;
+    SDL_Surface *sprites = nullptr;
+    SDL_Texture *tex = nullptr;
+    SDL_Texture *ground_texture = nullptr;
+    SDL_Texture *scene = nullptr;
+    std::ofstream high_score_fs;
+    std::vector<int> high_score_list;
+
+    /*
+     * Decoding the sprite sheet and reading the high scores don't need SDL,
+     * and opening the audio device and loading the sound don't need the
+     * display, so those run on workers while this thread makes the window
+     * and renderer (SDL wants video on the main thread). The two sides only
+     * meet at the texture upload.
+     */
+    typedef sp::TaskGraph Graph;
+    Graph startup;
+
+    Graph::Task sdl = startup.add("sdl", Graph::MAIN_THREAD, [&] {
+        if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) == -1) {
+            std::cerr << SDL_GetError() << std::endl;
+            return false;
+        }
+        return true;
+    });
+
+    Graph::Task audio = startup.add("audio", Graph::WORKER, [&] {
+        int audio_rate = 22050;
+        Uint16 audio_format = AUDIO_S16SYS;
+        int audio_channels = 2;
+        int audio_buffers = 4096;
+
+        // Initialize SDL_mixer
+        if(Mix_OpenAudio(audio_rate, audio_format, audio_channels, audio_buffers) == -1) {
+            printf("SDL_mixer could not initialize! SDL_mixer Error: %s\n", Mix_GetError());
+            return false;
+        }
+        return true;
+    }, { sdl });
+
+    startup.add("sound", Graph::WORKER, [&] {
+        g_score = Mix_LoadWAV("data/score.wav");
+        if(g_score == NULL) {
+            printf("Failed to load scratch sound effect! SDL_mixer Error: %s\n", Mix_GetError());
+            return false;
+        }
+        return true;
+    }, { audio });
+
+    Graph::Task window = startup.add("window", Graph::MAIN_THREAD, [&] {
+        win = SDL_CreateWindow("Crappy Bird", SDL_WINDOWPOS_CENTERED,
+                               SDL_WINDOWPOS_CENTERED, SCREEN_WIDTH,
+                               SCREEN_HEIGHT, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
+
+        if (win == nullptr) {
+            std::cerr << SDL_GetError() << std::endl;
+            return false;
+        }
+        SDL_SetWindowMinimumSize(win, SCENE_WIDTH, SCENE_HEIGHT);
+        return true;
+    }, { sdl });
+
+    Graph::Task render = startup.add("renderer", Graph::MAIN_THREAD, [&] {
+        // A fixed render rate is paced by hand, otherwise follow vsync
+        Uint32 renderer_flags = SDL_RENDERER_ACCELERATED;
+        if (headless)
+            renderer_flags = SDL_RENDERER_SOFTWARE;
+        else if (render_hz <= 0)
+            renderer_flags |= SDL_RENDERER_PRESENTVSYNC;
+
+        renderer = SDL_CreateRenderer(win, -1, renderer_flags);
+
+        if (renderer == nullptr) {
+            std::cerr << SDL_GetError() << std::endl;
+            return false;
+        }
+        return true;
+    }, { window });
+
+    Graph::Task decode = startup.add("sprites", Graph::WORKER, [&] {
+        sprites = IMG_Load("data/spritesheet.png");
+        if (sprites == nullptr) {
+            std::cerr << IMG_GetError() << std::endl;
+            return false;
+        }
+        return true;
+    });
+
+    startup.add("high scores", Graph::WORKER, [&] {
+        std::ifstream high_score_fs_in;
+
+        // Replays never add a score, so they don't create the file either
+        if (replay_path == nullptr) {
+            high_score_fs.open("highscore", std::fstream::out | std::fstream::app);
+            if (high_score_fs.fail()) {
+                std::cerr << "Failed to open highscore file\n";
+                return false;
+            }
+        }
+        high_score_fs_in.open("highscore", std::fstream::in);
+
+        int tmp_score;
+        while (high_score_fs_in >> tmp_score) {
+            high_score_list.push_back(tmp_score);
+        }
+        return true;
+    });
+
+    Graph::Task upload = startup.add("upload", Graph::MAIN_THREAD, [&] {
+        tex = SDL_CreateTextureFromSurface(renderer, sprites);
+        SDL_FreeSurface(sprites);
+        if (tex == nullptr) {
+            std::cerr << SDL_GetError() << std::endl;
+            return false;
+        }
+        return true;
+    }, { render, decode });
+
+    startup.add("targets", Graph::MAIN_THREAD, [&] {
+        int num_ground = NUM_GROUND;
+
+        SDL_Rect ground_rects[num_ground];
+
+        for (int i = 0; i < num_ground; i++) {
+            ground_rects[i] = { i * atlas::ground.w, 0, atlas::ground.w, atlas::ground.h };
+        }
+
+        Uint32 format;
+        int access;
+
+        SDL_QueryTexture(tex, &format, &access, NULL, NULL);
+        ground_texture = SDL_CreateTexture(renderer, format, access |
+                                           SDL_TEXTUREACCESS_TARGET,
+                                           atlas::ground.w * num_ground,
+                                           atlas::ground.h);
+        SDL_SetRenderTarget(renderer, ground_texture);
+        for (int i = 0; i < num_ground; i++)
+            sp::render_texture(renderer, tex, ground_rects[i], &atlas::ground);
+        SDL_SetRenderTarget(renderer, NULL);
+
+        /*
+         * Everything is drawn into the scene at the sprite sheet's own
+         * resolution, so each sprite costs its clip's pixels whatever the
+         * window size, then the scene is scaled to the window in one copy.
+         * The world keeps its units: a render scale of 1 / PIXEL_SCALE maps
+         * them onto it.
+         */
+        scene = SDL_CreateTexture(renderer, format, SDL_TEXTUREACCESS_TARGET,
+                                  SCENE_WIDTH, SCENE_HEIGHT);
+        if (scene == nullptr) {
+            std::cerr << SDL_GetError() << std::endl;
+            return false;
+        }
+        return true;
+    }, { upload });
+
+    bool started = startup.run();
+    if (profile)
+        startup.report(std::cerr);
+    if (!started) {
+        SDL_Quit();
         return 1;
     }
 
     FlappyFuch player = FlappyFuch(SCREEN_WIDTH / 12,
                                    SCREEN_HEIGHT / 2 - 60);
 
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    std::default_random_engine generator(seed);
-    std::uniform_int_distribution<int> distribution(0, SCREEN_HEIGHT - 60 - 12 * 4 - 90);
-    auto y_gen = std::bind(distribution, generator);
+    RunLogBuffer run_log_buffer(run_log);
+    Simulation sim(seed, step, fixed);
+    if (replay_path != nullptr)
+        sim.set_replay(&replay);
+    if (record_path != nullptr)
+        sim.set_recorder(&recorder);
+    if (run_log_path != nullptr)
+        sim.set_run_log(&run_log_buffer);
+
+    std::unique_ptr<sp::FrameCapture> capture;
+    if (capture_path != nullptr) {
+        capture.reset(new sp::FrameCapture(capture_path, SCENE_WIDTH,
+                                           SCENE_HEIGHT, CAPTURE_FPS));
+        if (!capture->start())
+            return 1;
+    }
 
     std::vector<Obstacle> obstacles;
 
-    for(int i = 0; i < (SCREEN_WIDTH / 100); i++) {
-        Obstacle temp_obs = Obstacle(600 + i * 200, y_gen(), 0, SCREEN_HEIGHT - 60, 90);
+    for(int i = 0; i < NUM_OBSTACLES; i++) {
+        Obstacle temp_obs = World::make_obstacle(ArcadeRules::first_pipe_x +
+                                                   i * ArcadeRules::pipe_spacing, 0);
         temp_obs.set_texture(tex);
         obstacles.push_back(temp_obs);
     }
 
     player.set_texture(tex);
 
-    SDL_Rect background = {
-        .x = 0,
-        .y = 0,
-        .w = 143,
-        .h = 255
-    };
-
     SDL_Rect background_rects[SCREEN_WIDTH / 143];
 
     for (int i = 0; i < (SCREEN_WIDTH / 143); i++) {
@@ -665,68 +1095,24 @@ int main(int argc, char *argv[]) {
         };
     }
 
-    int num_ground = SCREEN_WIDTH / (154 * 2) + 1;
-    SDL_Rect ground = { 146, 0, 154, 55 };
-
-    SDL_Rect ground_rects[num_ground];
-
-    for (int i = 0; i < num_ground; i++) {
-        ground_rects[i] = {i * 154 * 2, 0, 154 * 2, 55 * 2 };
-    }
-
-    Uint32 format;
-    int access;
-
-    SDL_QueryTexture(tex, &format, &access, NULL, NULL);
-    SDL_Texture *ground_texture = SDL_CreateTexture(renderer, format, access |
-                                                    SDL_TEXTUREACCESS_TARGET,
-                                                    154 * 2 * num_ground, 55 * 2);
-    SDL_SetRenderTarget(renderer, ground_texture);
-    for (int i = 0; i < num_ground; i++)
-        sp::render_texture(renderer, tex, ground_rects[i], &ground);
-    SDL_SetRenderTarget(renderer, NULL);
-
-    float ground_x_1 = 0.0f;
-    float ground_x_2 = ground_x_1 + 154 * 2 * num_ground;
-    Obstacle & last = obstacles.back();
-
-    CollisionBank col_bank;
-    col_bank.register_entity(&player);
+    int output_w, output_h;
+    SDL_GetRendererOutputSize(renderer, &output_w, &output_h);
+    SDL_Rect screen = sp::integer_fit(output_w, output_h, SCENE_WIDTH, SCENE_HEIGHT);
 
+    // The player stays on screen and goes over the score, so only the
+    // obstacles are culled
+    DrawList draw_list;
     for (Entity & i : obstacles) {
-        col_bank.register_entity(&i);
+        draw_list.register_entity(&i);
     }
 
-    SDL_Rect numbers[20] = {
-        { 288, 100, 8, 10 }, // 0
-        { 288, 118, 8, 10 }, // 1
-        { 288, 134, 8, 10 }, // 2
-        { 288, 150, 8, 10 }, // 3
-        { 287, 173, 8, 10 }, // 4
-        { 287, 185, 8, 10 }, // 5
-        { 165, 245, 8, 10 }, // 6
-        { 175, 245, 8, 10 }, // 7
-        { 185, 245, 8, 10 }, // 8
-        { 195, 245, 8, 10 }, // 9
-
-        { 288, 74,  6, 7 },  // 0_i
-        { 289, 162, 6, 7 },  // 1_i
-        { 204, 245, 6, 7 },  // 2_i
-        { 212, 245, 6, 7 },  // 3_i
-        { 220, 245, 6, 7 },  // 4_i
-        { 228, 245, 6, 7 },  // 5_i
-        { 284, 197, 6, 7 },  // 6_i
-        { 292, 197, 6, 7 },  // 7_i
-        { 284, 213, 6, 7 },  // 8_i
-        { 292, 213, 6, 7 },  // 9_i
-    };
+    SDL_Rect view = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
+    sp::Profiler profiler;
+    if (profile)
+        profiler.set_enabled(true);
 
     bool mouse_down = false;
 
-    SDL_Rect game_over_src = {
-        146, 199, 94, 19
-    };
-
     SDL_Rect game_over_dest = {
         SCREEN_WIDTH / 2 - 94,
         SCREEN_HEIGHT / 2 - 19 * 5,
@@ -734,10 +1120,6 @@ int main(int argc, char *argv[]) {
         19 * 2
     };
 
-    SDL_Rect score_board_src = {
-        146, 58, 113, 58
-    };
-
     SDL_Rect score_board_dest = {
         SCREEN_WIDTH / 2 - 113,
         SCREEN_HEIGHT / 2 - 19 * 2,
@@ -745,18 +1127,10 @@ int main(int argc, char *argv[]) {
         58 * 2
     };
 
-    SDL_Rect ok_src = {
-        246, 134, 40, 14
-    };
-
     SDL_Rect ok_dest = {
         40, SCREEN_HEIGHT - 100, 40 * 2, 14 * 2
     };
 
-    SDL_Rect tap_src = {
-        160, 117, 48, 53
-    };
-
     SDL_Rect tap_dest = {
         SCREEN_WIDTH / 2 - 48,
         SCREEN_HEIGHT / 2 - 53,
@@ -769,158 +1143,172 @@ int main(int argc, char *argv[]) {
 
     bool set_best_score = false;
 
-    player.set_idle();
+    int best_score = 0;
+    if (high_score_list.size()) {
+        best_score = *std::max_element(high_score_list.begin(),
+                                       high_score_list.end());
+    };
 
-    std::ifstream high_score_fs_in;
-    std::ofstream high_score_fs;
+    int heard_score = 0;
+    unsigned long last_sim_tick = 0;
+    unsigned long last_sim_wakeups = 0;
+    // When the last frame was looked at, drawn or not
+    unsigned long last_frame = 0;
+    uint64_t last_present = 0;
+    bool skipped = false;
+    RenderKey last_key;
+    memset(&last_key, 0, sizeof(last_key));
+
+    auto handle_event = [&](const SDL_Event &event) {
+        switch (event.type) 
+        {
+            case SDL_KEYUP:                  
+                switch (event.key.keysym.sym)
+                {
+                    case SDLK_ESCAPE:
+                        quit = true;
+                        break;
+                }
+                break;
 
-    high_score_fs.open("highscore", std::fstream::out | std::fstream::app);
-    high_score_fs_in.open("highscore", std::fstream::in);
+            case SDL_MOUSEBUTTONDOWN:
+                mouse_down = true;
+                break;
 
-    if (high_score_fs_in.fail() || high_score_fs.fail() ) {
-        std::cerr << "Failed to open highscore file\n";
-        return 1;
-    }
+            case SDL_MOUSEBUTTONUP:
+                mouse_down = false;
+                break;
 
-    std::vector<int> high_score_list;
-    int tmp_score;
-    while (high_score_fs_in >> tmp_score) {
-        high_score_list.push_back(tmp_score);
-    }
+            case SDL_QUIT:
+                quit = true;
+        }
+    };
+    double next_frame = now_seconds();
 
-    high_score_fs_in.close();
+    /*
+     * Headless runs drive the simulation from here instead of its thread,
+     * stepping it by however many ticks fit in each 1/CAPTURE_FPS of game
+     * time, so they run as fast as frames can be drawn and encoded and
+     * every run of the same replay gives the same frames.
+     */
+    double frame_time = 0;
+    if (!headless)
+        sim.start();
 
-    int best_score = 0;
-    if (high_score_list.size()) {
-        best_score = *std::max_element(high_score_list.begin(),
-                                       high_score_list.end());
-    };
+    unsigned long frames_drawn = 0;
+    double loop_start = now_seconds();
 
     while (!quit) {
-        delta = SDL_GetTicks() - last_tick;
-        last_tick = SDL_GetTicks();
-        ticks += delta;
+        if (headless) {
+            frame_time += 1000.0 / CAPTURE_FPS;
+            while (sim.get_ticks() * sim.get_step() < frame_time)
+                sim.advance(1);
+        }
+
+        sim.update();
+        const SimFrame &frame = sim.latest();
+
+        /*
+         * Nothing moves on the menu but the bird's wings and the tap hint,
+         * and nothing at all once a dead bird has settled. In those cases
+         * sleep in SDL_WaitEventTimeout until the next animation frame is
+         * due or some input arrives, instead of polling flat out.
+         */
+        bool settled = frame.curr.dead && same_state(frame.prev, frame.curr);
+        int timeout = 0;
+        if (headless || capture)
+            timeout = 0;
+        else if (settled)
+            timeout = 500;
+        else if (frame.curr.idle)
+            timeout = std::max<int64_t>(0, (int64_t)last_frame + 1000 / IDLE_ANIMATION_HZ
+                                           - (int64_t)SDL_GetTicks());
+        else if (skipped)
+            timeout = std::max(1, (int)(sim.get_step() - (now_seconds() - frame.curr.time) * 1000));
+
+        bool woken = false;
+        if (timeout > 0 && SDL_WaitEventTimeout(&event, timeout)) {
+            handle_event(event);
+            woken = true;
+        }
 
         /*
          * Poll for events, and handle the ones we care about.
          * When a user presses 'n', it handles a single step of a
          * game of life generation
          */
-        while (SDL_PollEvent(&event)) 
-        {
-            switch (event.type) 
-            {
-                case SDL_KEYUP:                  
-                    switch (event.key.keysym.sym)
-                    {
-                        case SDLK_ESCAPE:
-                            quit = true;
-                            break;
-                    }
-                    break;
-
-                case SDL_MOUSEBUTTONDOWN:
-                    mouse_down = true;
-                    break;
-
-                case SDL_MOUSEBUTTONUP:
-                    mouse_down = false;
-                    break;
-
-                case SDL_QUIT:
-                    quit = true;
-            }
+        while (SDL_PollEvent(&event)) {
+            handle_event(event);
+            woken = true;
         }
 
+        profiler.count(sp::Profiler::WAKEUPS);
+        last_tick = headless ? (Uint32)frame_time : SDL_GetTicks();
+
+        if (sim.is_replay_done())
+            quit = true;
 
         const Uint8 *state = SDL_GetKeyboardState(NULL);
-        if (!lock_flap && state[SDL_SCANCODE_SPACE])
+        if (replay_path == nullptr && !lock_flap && state[SDL_SCANCODE_SPACE])
         {
-            player.set_active();
             lock_flap = true;
-            player.flap();
+            sim.send(INPUT_FLAP);
         } else if(!state[SDL_SCANCODE_SPACE]) {
             lock_flap = false;
         }
 
-        col_bank.dispatch_collisions();
-
-        if (!player.is_dead()) {
-            ground_x_1 -= SPEED * (delta / 1000.0f);
-            ground_x_2 -= SPEED * (delta / 1000.0f);
-        }
-
-        if (ground_x_1 <= -(154 * 2 * num_ground))
-            ground_x_1 = ground_x_2 + 154 * 2 * num_ground;
+        float alpha;
+        if (headless)
+            alpha = 1 - (sim.get_ticks() * sim.get_step() - frame_time) / sim.get_step();
+        else
+            alpha = (now_seconds() - frame.curr.time) * 1000.0 / sim.get_step();
+        alpha = std::min(1.0f, std::max(0.0f, alpha));
 
-        if (ground_x_2 <= -(154 * 2 * num_ground))
-            ground_x_2 = ground_x_1 + 154 * 2 * num_ground;
+        WorldSnapshot snap;
+        interpolate(frame.prev, frame.curr, alpha, snap);
 
-        player.update(delta);
+        profiler.count(sp::Profiler::TICKS, snap.tick - last_sim_tick);
+        profiler.count(sp::Profiler::WAKEUPS, sim.get_wakeups() - last_sim_wakeups);
+        last_sim_tick = snap.tick;
+        last_sim_wakeups = sim.get_wakeups();
 
-        if (!player.is_idle() && !player.is_dead()) {
-            for (std::vector<Obstacle>::iterator it = obstacles.begin(); it != obstacles.end(); it++) {
-                it->update(delta);
-                if (it->get_x() + it->get_width() <= 0) {
-                    it->set_x(last.get_x() + 200);
-                    it->set_height(y_gen());
-                    last = *it;
-                }
+        if (snap.score > heard_score) {
+            if (Mix_PlayChannel(-1, g_score, 0) == -1 ) {
+                std::cerr << "Mix_PlayChannel: " << Mix_GetError() << std::endl;
+            } else {
+                sp::Telemetry::count(sp::Telemetry::AUDIO_TRIGGERS);
             }
         }
+        heard_score = snap.score;
 
-        std::vector<int> score_array = digit_to_array(player.get_score());
-        std::vector<SDL_Rect> score_dest_rect;
-
-        for (int i = 0; i < score_array.size(); i++) {
-            SDL_Rect dest = {
-                (int)((SCREEN_WIDTH / 2) - (score_array.size() - i) * 8 * 4),
-                10,
-                32,
-                40
-            };
-
-            score_dest_rect.push_back(dest);
-        }
-    
         /**
          * User Interface
          */
 
-        int mouse_x, mouse_y;
+        // The mouse is in window coordinates and screen in output pixels,
+        // which are more of them on a high-DPI display
+        int mouse_x, mouse_y, window_w, window_h;
         SDL_GetMouseState(&mouse_x, &mouse_y);
+        SDL_GetWindowSize(win, &window_w, &window_h);
+        if (window_w > 0 && window_h > 0) {
+            mouse_x = mouse_x * output_w / window_w;
+            mouse_y = mouse_y * output_h / window_h;
+        }
+        mouse_x = (mouse_x - screen.x) * SCREEN_WIDTH / screen.w;
+        mouse_y = (mouse_y - screen.y) * SCREEN_HEIGHT / screen.h;
 
-        SDL_RenderClear(renderer);
-
-        for (int i = 0; i < (SCREEN_WIDTH / 143); i++)
-            sp::render_texture(renderer, tex, background_rects[i], &background);
-
-        sp::render_texture(renderer, ground_texture, (int)ground_x_1, SCREEN_HEIGHT - 60);
-        sp::render_texture(renderer, ground_texture, (int)ground_x_2, SCREEN_HEIGHT - 60);
-
-        for (std::vector<Obstacle>::iterator it = obstacles.begin(); it != obstacles.end(); it++)
-            it->draw(renderer);
-
-        if (!player.is_dead())
-            for (int i = 0; i < score_dest_rect.size(); i++) {
-                sp::render_texture(renderer, tex, score_dest_rect[i], &numbers[score_array[i]]);
-            }
-
-        player.draw(renderer);
-
-        // sp::render_texture(renderer, tex, start_dest, &start_btn);
-
-        if (player.is_dead()) {
+        if (!snap.dead)
+            set_best_score = false;
 
-            high_score_list.push_back(player.get_score());
+        if (snap.dead) {
 
-            if (high_score_list.size()) {
+            if (!set_best_score) {
+                high_score_list.push_back(snap.score);
                 best_score = *std::max_element(high_score_list.begin(),
                         high_score_list.end());
-            };
 
-            if (!set_best_score) {
-                high_score_fs << player.get_score() << std::endl;
+                if (replay_path == nullptr)
+                    high_score_fs << snap.score << std::endl;
                 set_best_score = true;
             }
 
@@ -938,26 +1326,92 @@ int main(int argc, char *argv[]) {
                 }
                 else if (ok_active && !mouse_down) {
                     // reset the game
-                    player.set_alive();
-                    player.set_idle();
-                    player.set_y(SCREEN_HEIGHT / 2 - 60);
-                    set_best_score = false;
-
-                    for (int i = 0; i < obstacles.size(); i++)
-                        obstacles[i].set_x(600 + 200 * i);
+                    if (replay_path == nullptr)
+                        sim.send(INPUT_RESET);
 
                     ok_active = false;
                     ok_dest.y -= 5;
                 }
             }
+        }
+
+        /* The simulation sleeps on the menu, so the wings flap on the
+         * render clock there, like the tap hint bobs */
+        if (snap.idle) {
+            tap_dest.y = SCREEN_HEIGHT / 2 + 5 * cos(last_tick / 120.0f);
+            snap.player_frame = (last_tick / WING_FRAME_MS) % 4;
+        }
+
+        // Only draw when something on screen actually changed
+        last_frame = SDL_GetTicks();
+        RenderKey key = make_render_key(snap, tap_dest.y, ok_dest.y, best_score);
+        skipped = !woken && !capture && key == last_key;
+        if (skipped) {
+            profiler.report(SDL_GetTicks());
+            continue;
+        }
+        last_key = key;
+
+        apply_snapshot(snap, player, obstacles);
+
+        std::vector<int> score_array = digit_to_array(snap.score);
+        std::vector<SDL_Rect> score_dest_rect;
+
+        for (int i = 0; i < score_array.size(); i++) {
+            SDL_Rect dest = {
+                (int)((SCREEN_WIDTH / 2) - (score_array.size() - i) * 8 * 4),
+                10,
+                32,
+                40
+            };
+
+            score_dest_rect.push_back(dest);
+        }
+
+        SDL_SetRenderTarget(renderer, scene);
+        SDL_RenderSetScale(renderer, 1.0f / PIXEL_SCALE, 1.0f / PIXEL_SCALE);
+        SDL_RenderClear(renderer);
+
+        for (int i = 0; i < (SCREEN_WIDTH / 143); i++)
+            sp::render_texture(renderer, tex, background_rects[i], &atlas::background);
+
+        SDL_Rect ground_dest = {
+            (int)snap.ground_x_1, SCREEN_HEIGHT - 60,
+            GROUND_WIDTH, atlas::ground.h * PIXEL_SCALE
+        };
+        sp::render_texture(renderer, ground_texture, ground_dest);
+        ground_dest.x = (int)snap.ground_x_2;
+        sp::render_texture(renderer, ground_texture, ground_dest);
+
+        if (ghosts.get_count() > 0) {
+            ghosts.advance(snap.run_ticks);
+            profiler.count(sp::Profiler::DRAWN, ghosts.draw(renderer, tex, snap.player_x,
+                                                            alpha, GHOST_OPACITY));
+        }
+
+        draw_list.build(view);
+        draw_list.draw(renderer);
+        profiler.count(sp::Profiler::DRAWN, draw_list.get_drawn());
+        profiler.count(sp::Profiler::CULLED, draw_list.get_culled());
+
+        if (!snap.dead)
+            for (int i = 0; i < score_dest_rect.size(); i++) {
+                sp::render_texture(renderer, tex, score_dest_rect[i], &atlas::digits[score_array[i]]);
+            }
 
-            sp::render_texture(renderer, tex, game_over_dest, &game_over_src);
-            sp::render_texture(renderer, tex, score_board_dest, &score_board_src);
-            sp::render_texture(renderer, tex, ok_dest, &ok_src);
+        player.draw(renderer);
+        profiler.count(sp::Profiler::DRAWN);
+
+        // sp::render_texture(renderer, tex, start_dest, &start_btn);
+
+        if (snap.dead) {
+            sp::render_texture(renderer, tex, game_over_dest, &atlas::game_over);
+            sp::render_texture(renderer, tex, score_board_dest, &atlas::score_board);
+            sp::render_texture(renderer, tex, ok_dest, &atlas::ok_button);
 
             std::vector<SDL_Rect> tmp_score_dest_rect;
             std::vector<SDL_Rect> tmp_best_score_dest_rect;
-            std::vector<int> high_score = digit_to_array(player.get_score());
+            std::vector<int> high_score = digit_to_array(snap.score);
             std::vector<int> best_score_vec = digit_to_array(best_score);
 
             for (int i = high_score.size() - 1; i >= 0; i--) {
@@ -983,21 +1437,61 @@ int main(int argc, char *argv[]) {
             }
 
             for (int i = 0; i < tmp_score_dest_rect.size(); i++) {
-                sp::render_texture(renderer, tex, tmp_score_dest_rect[i], &numbers[high_score[i] + 10]);
+                sp::render_texture(renderer, tex, tmp_score_dest_rect[i], &atlas::small_digits[high_score[i]]);
             }
 
             for (int i = 0; i < best_score_vec.size(); i++) {
-                sp::render_texture(renderer, tex, tmp_best_score_dest_rect[i], &numbers[best_score_vec[i] + 10]);
+                sp::render_texture(renderer, tex, tmp_best_score_dest_rect[i], &atlas::small_digits[best_score_vec[i]]);
             }
         }
 
-        if (player.is_idle()) {
-            tap_dest.y = SCREEN_HEIGHT / 2 + 5 * cos(last_tick / 120.0f);
+        if (snap.idle)
+            sp::render_texture(renderer, tex, tap_dest, &atlas::tap);
 
-            sp::render_texture(renderer, tex, tap_dest, &tap_src);
-        }
+        if (capture)
+            capture->capture(renderer);
 
+        uint64_t present_start = sp::Telemetry::now();
+        SDL_SetRenderTarget(renderer, NULL);
+        SDL_GetRendererOutputSize(renderer, &output_w, &output_h);
+        screen = sp::integer_fit(output_w, output_h, SCENE_WIDTH, SCENE_HEIGHT);
+        SDL_RenderClear(renderer);
+        SDL_RenderCopy(renderer, scene, NULL, &screen);
         SDL_RenderPresent(renderer);
+        uint64_t present_end = sp::Telemetry::now();
+        sp::Telemetry::record(sp::Telemetry::PRESENT_TIME, present_end - present_start);
+        if (last_present != 0)
+            sp::Telemetry::record(sp::Telemetry::FRAME_TIME, present_end - last_present);
+        last_present = present_end;
+        frames_drawn++;
+        if (profile && frames_drawn == 1)
+            std::cerr << "First frame " << (now_seconds() - process_start) * 1000
+                      << " ms after launch" << std::endl;
+        sp::Telemetry::count(sp::Telemetry::FRAMES);
+        profiler.end_frame();
+        profiler.report(SDL_GetTicks());
+
+        if (render_hz > 0 && !headless) {
+            next_frame += 1.0 / render_hz;
+            double wait = next_frame - now_seconds();
+            if (wait > 0)
+                SDL_Delay((Uint32)(wait * 1000));
+            else
+                next_frame = now_seconds();
+        }
+    }
+
+    sim.stop();
+
+    if (headless) {
+        std::cout << "Rendered " << frames_drawn << " frames in "
+                  << now_seconds() - loop_start << " s" << std::endl;
+    }
+
+    if (capture) {
+        capture->stop();
+        std::cout << "Captured " << capture->get_frame_count() << " frames to "
+                  << capture_path << std::endl;
     }
 
     while(Mix_Playing(-1) != 0);
@@ -1009,6 +1503,7 @@ int main(int argc, char *argv[]) {
 
     SDL_DestroyTexture(tex);
     SDL_DestroyTexture(ground_texture);
+    SDL_DestroyTexture(scene);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(win);
 
@@ -0,0 +1,228 @@
+/*
+ * Reads the telemetry a running cf publishes with --stats NAME and prints
+ * it: every counter with its rate, and percentiles for every histogram.
+ * The first report covers everything since the game started, and each one
+ * after that only the last interval, so a hitch shows up when it happens.
+ *
+ * Names come from the segment itself, so this keeps working against a
+ * game built with more counters than it knows about.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "telemetry.hpp"
+
+
+/**
+ * A copy of the segment's values at one moment
+ */
+struct Sample
+{
+    std::vector<uint64_t> counters;
+    std::vector<uint64_t> sums;
+    std::vector<std::vector<uint64_t> > buckets;
+};
+
+
+static const uint8_t *map_segment(const char *name, size_t &size)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) != 0) {
+        perror(name);
+        if (fd != -1)
+            close(fd);
+        return nullptr;
+    }
+
+    size = info.st_size;
+    void *p = size >= sizeof(sp::TelemetryHeader)
+        ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED) {
+        std::cerr << name << " is not a telemetry segment" << std::endl;
+        return nullptr;
+    }
+
+    const sp::TelemetryHeader *header = (const sp::TelemetryHeader *)p;
+    if (header->magic.load(std::memory_order_acquire) != TELEMETRY_MAGIC ||
+        header->version != TELEMETRY_VERSION || header->size > size ||
+        header->buckets != TELEMETRY_BUCKETS || header->sub_bits != TELEMETRY_SUB_BITS ||
+        header->shards != TELEMETRY_SHARDS ||
+        header->counters_offset + header->counters * sizeof(sp::TelemetryCounter) > size ||
+        header->histograms_offset + header->histograms * sizeof(sp::TelemetryHistogram) > size) {
+        std::cerr << name << " is not a telemetry segment this cf-stat can read" << std::endl;
+        munmap(p, size);
+        return nullptr;
+    }
+    return (const uint8_t *)p;
+}
+
+
+static void take_sample(const sp::TelemetryHeader *header, Sample &sample)
+{
+    const uint8_t *base = (const uint8_t *)header;
+    const sp::TelemetryCounter *counters = (const sp::TelemetryCounter *)(base + header->counters_offset);
+    const sp::TelemetryHistogram *histograms = (const sp::TelemetryHistogram *)(base + header->histograms_offset);
+
+    sample.counters.resize(header->counters);
+    for (uint32_t i = 0; i < header->counters; i++)
+        sample.counters[i] = counters[i].total();
+
+    sample.sums.resize(header->histograms);
+    sample.buckets.resize(header->histograms);
+    for (uint32_t i = 0; i < header->histograms; i++) {
+        sample.sums[i] = histograms[i].sum.load(std::memory_order_relaxed);
+        sample.buckets[i].resize(TELEMETRY_BUCKETS);
+        for (int b = 0; b < TELEMETRY_BUCKETS; b++)
+            sample.buckets[i][b] = histograms[i].buckets[b].load(std::memory_order_relaxed);
+    }
+}
+
+
+/**
+ * The value at a percentile of a histogram, as the middle of its bucket
+ */
+static double percentile(const std::vector<uint64_t> &buckets, uint64_t count, double p)
+{
+    uint64_t rank = (uint64_t)(count * p / 100.0);
+    uint64_t seen = 0;
+    for (int b = 0; b < TELEMETRY_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > rank) {
+            uint64_t low = sp::telemetry_bucket_low(b);
+            uint64_t high = b + 1 < TELEMETRY_BUCKETS ? sp::telemetry_bucket_low(b + 1) : low;
+            return (low + high) / 2.0;
+        }
+    }
+    return 0;
+}
+
+
+static void report(const sp::TelemetryHeader *header, const Sample &now,
+                   const Sample &then, double seconds)
+{
+    const uint8_t *base = (const uint8_t *)header;
+    const sp::TelemetryCounter *counters = (const sp::TelemetryCounter *)(base + header->counters_offset);
+    const sp::TelemetryHistogram *histograms = (const sp::TelemetryHistogram *)(base + header->histograms_offset);
+
+    std::cout << "pid " << header->pid << ", over " << std::fixed << std::setprecision(1)
+              << seconds << " s\n";
+
+    for (uint32_t i = 0; i < header->counters; i++) {
+        uint64_t delta = now.counters[i] - then.counters[i];
+        std::cout << "  " << std::left << std::setw(20)
+                  << std::string(counters[i].name, strnlen(counters[i].name, TELEMETRY_NAME_SIZE))
+                  << std::right << std::setw(14) << now.counters[i]
+                  << std::setw(14) << std::setprecision(1) << delta / seconds << "/s\n";
+    }
+
+    std::cout << "  " << std::left << std::setw(20) << "(microseconds)" << std::right
+              << std::setw(10) << "count" << std::setw(10) << "mean"
+              << std::setw(10) << "p50" << std::setw(10) << "p90"
+              << std::setw(10) << "p99" << std::setw(10) << "p99.9" << "\n";
+
+    for (uint32_t i = 0; i < header->histograms; i++) {
+        std::vector<uint64_t> buckets(TELEMETRY_BUCKETS);
+        uint64_t count = 0;
+        for (int b = 0; b < TELEMETRY_BUCKETS; b++) {
+            buckets[b] = now.buckets[i][b] - then.buckets[i][b];
+            count += buckets[b];
+        }
+        uint64_t sum = now.sums[i] - then.sums[i];
+
+        std::cout << "  " << std::left << std::setw(20)
+                  << std::string(histograms[i].name, strnlen(histograms[i].name, TELEMETRY_NAME_SIZE))
+                  << std::right << std::setw(10) << count << std::setprecision(1);
+        if (count == 0) {
+            std::cout << "\n";
+            continue;
+        }
+        std::cout << std::setw(10) << sum / 1000.0 / count;
+        const double ps[] = { 50, 90, 99, 99.9 };
+        for (double p : ps)
+            std::cout << std::setw(10) << percentile(buckets, count, p) / 1000.0;
+        std::cout << "\n";
+    }
+    std::cout << std::endl;
+}
+
+
+static volatile sig_atomic_t quit = 0;
+
+static void on_signal(int)
+{
+    quit = 1;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *name = "/cf-stats";
+    double interval = 1;
+    bool once = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--interval") && i + 1 < argc) {
+            interval = std::max(0.1, atof(argv[++i]));
+        } else if (!strcmp(argv[i], "--once")) {
+            once = true;
+        } else if (argv[i][0] != '-') {
+            name = argv[i];
+        } else {
+            std::cerr << "usage: " << argv[0] << " [NAME] [--interval S] [--once]\n";
+            return 1;
+        }
+    }
+
+    size_t size;
+    const uint8_t *base = map_segment(name, size);
+    if (base == nullptr)
+        return 1;
+    const sp::TelemetryHeader *header = (const sp::TelemetryHeader *)base;
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    Sample then, now;
+    take_sample(header, now);
+    then = now;
+    for (size_t i = 0; i < then.counters.size(); i++)
+        then.counters[i] = 0;
+    for (size_t i = 0; i < then.sums.size(); i++) {
+        then.sums[i] = 0;
+        std::fill(then.buckets[i].begin(), then.buckets[i].end(), 0);
+    }
+
+    double seconds = std::max<double>(1, time(nullptr) - (time_t)header->start_time);
+    report(header, now, then, seconds);
+
+    while (!once && !quit) {
+        then = now;
+        std::this_thread::sleep_for(std::chrono::duration<double>(interval));
+        take_sample(header, now);
+        report(header, now, then, interval);
+
+        // Stop once the game has gone away
+        if (kill(header->pid, 0) != 0)
+            break;
+    }
+
+    munmap((void *)base, size);
+    return 0;
+}
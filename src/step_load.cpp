@@ -0,0 +1,424 @@
+/*
+ * Synthetic load for the step server (cf --serve or --serve-shm). Each client thread
+ * opens a connection with a number of sessions, then steps all of them
+ * together over and over, flapping at random and resetting dead birds,
+ * the way a batch of training environments would. Every step's latency
+ * is measured from when its request went out.
+ *
+ * At the end it prints throughput, latency percentiles and how many real
+ * time sessions (each wanting --hz steps a second) one core of the server
+ * could keep up with, measured from the server's own CPU time.
+ *
+ * With --shm there is a single client, the trainer, stepping the first
+ * --sessions sessions of the segment with one command per batch, so the
+ * two transports can be compared like for like.
+ */
+
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "step_protocol.hpp"
+#include "step_shm.hpp"
+
+// Latency histogram buckets, LATENCY_RESOLUTION nanoseconds each
+#define LATENCY_BUCKETS 1000000
+#define LATENCY_RESOLUTION 100
+
+typedef std::chrono::steady_clock Clock;
+
+
+struct ClientStats
+{
+    ClientStats() : latency(LATENCY_BUCKETS + 1), steps(0), resets(0), errors(0) {}
+
+    std::vector<unsigned int> latency;
+    unsigned long steps, resets, errors;
+};
+
+
+static int connect_to(const char *path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror(path);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+    const char *p = (const char *)data;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+static bool read_all(int fd, void *data, size_t size)
+{
+    char *p = (char *)data;
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+/**
+ * CPU time the process has used so far, in seconds, or -1
+ */
+static double process_cpu_seconds(pid_t pid)
+{
+    std::ostringstream name;
+    name << "/proc/" << pid << "/stat";
+    std::ifstream in(name.str().c_str());
+    std::string stat;
+    if (!std::getline(in, stat))
+        return -1;
+
+    // Fields 14 and 15 are utime and stime; skip past the command name,
+    // which is in parentheses and may contain spaces
+    std::istringstream fields(stat.substr(stat.rfind(')') + 2));
+    std::string field;
+    unsigned long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; i++) {
+        if (i == 14)
+            utime = strtoul(field.c_str(), nullptr, 10);
+        else if (i == 15)
+            stime = strtoul(field.c_str(), nullptr, 10);
+    }
+
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+
+static pid_t server_pid(const char *path)
+{
+    int fd = connect_to(path);
+    if (fd == -1)
+        return -1;
+
+    ucred cred;
+    socklen_t size = sizeof(cred);
+    pid_t pid = -1;
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) == 0)
+        pid = cred.pid;
+
+    close(fd);
+    return pid;
+}
+
+
+static void record_latency(ClientStats &stats, Clock::time_point sent, size_t count)
+{
+    long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - sent).count();
+    stats.latency[std::min<long>(ns / LATENCY_RESOLUTION, LATENCY_BUCKETS)] += count;
+}
+
+
+static void run_client(const char *path, int sessions, unsigned seed,
+                       const std::atomic<bool> &running, ClientStats &stats)
+{
+    int fd = connect_to(path);
+    if (fd == -1) {
+        stats.errors++;
+        return;
+    }
+
+    std::vector<StepRequest> requests(sessions);
+    std::vector<StepReply> replies(sessions);
+    std::vector<uint32_t> ids(sessions);
+    std::vector<bool> dead(sessions, false);
+
+    memset(requests.data(), 0, requests.size() * sizeof(StepRequest));
+    for (int i = 0; i < sessions; i++) {
+        requests[i].op = STEP_OPEN;
+        requests[i].version = STEP_PROTOCOL_VERSION;
+        requests[i].arg = seed + i;
+    }
+
+    if (!write_all(fd, requests.data(), sessions * sizeof(StepRequest)) ||
+        !read_all(fd, replies.data(), sessions * sizeof(StepReply))) {
+        stats.errors++;
+        close(fd);
+        return;
+    }
+
+    for (int i = 0; i < sessions; i++) {
+        if (replies[i].status != STEP_OK) {
+            std::cerr << "Failed to open a session (status "
+                      << (int)replies[i].status << ")" << std::endl;
+            stats.errors++;
+            close(fd);
+            return;
+        }
+        ids[i] = replies[i].session;
+    }
+
+    uint32_t random = seed * 2654435761u + 1;
+
+    while (running) {
+        for (int i = 0; i < sessions; i++) {
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+
+            requests[i].session = ids[i];
+            requests[i].version = 0;
+            if (dead[i]) {
+                requests[i].op = STEP_RESET;
+                requests[i].action = 0;
+                requests[i].arg = random;
+            } else {
+                requests[i].op = STEP_STEP;
+                requests[i].action = (random & 7) == 0;
+            }
+        }
+
+        Clock::time_point sent = Clock::now();
+        if (!write_all(fd, requests.data(), sessions * sizeof(StepRequest))) {
+            stats.errors++;
+            break;
+        }
+
+        // Replies trickle in as the server's batches finish; time each
+        // chunk as it arrives
+        size_t got = 0, want = sessions * sizeof(StepReply);
+        char *buffer = (char *)replies.data();
+        while (got < want) {
+            ssize_t n = recv(fd, buffer + got, want - got, 0);
+            if (n <= 0) {
+                stats.errors++;
+                close(fd);
+                return;
+            }
+
+            size_t before = got / sizeof(StepReply);
+            got += n;
+            size_t after = got / sizeof(StepReply);
+
+            record_latency(stats, sent, after - before);
+        }
+
+        for (int i = 0; i < sessions; i++) {
+            const StepReply &r = replies[i];
+            if (r.status != STEP_OK) {
+                stats.errors++;
+                continue;
+            }
+
+            // Replies can come back in any order
+            size_t k = i;
+            if (ids[k] != r.session)
+                for (k = 0; k < ids.size() && ids[k] != r.session; k++);
+            if (k == ids.size())
+                continue;
+
+            if (r.op == STEP_STEP) {
+                stats.steps++;
+                dead[k] = r.dead;
+            } else {
+                stats.resets++;
+                dead[k] = false;
+            }
+        }
+    }
+
+    close(fd);
+}
+
+
+static void run_shm_client(const char *name, int sessions, unsigned seed,
+                           const std::atomic<bool> &running, ClientStats &stats)
+{
+    ShmStepClient client;
+    if (!client.open(name)) {
+        stats.errors++;
+        return;
+    }
+
+    uint32_t n = std::min<uint32_t>(sessions, client.get_sessions());
+    uint8_t *actions = client.get_segment().actions();
+    const uint8_t *dead = client.get_segment().dead();
+    uint32_t random = seed * 2654435761u + 1;
+
+    while (running) {
+        int in_flight = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+
+            actions[i] = (random & 7) == 0;
+            if (dead[i]) {
+                client.submit(STEP_RESET, i, 1, random);
+                stats.resets++;
+                in_flight++;
+            }
+
+            // The result ring only has room for so many
+            if (in_flight == SHM_RING_SIZE || (i == n - 1 && in_flight > 0)) {
+                for (; in_flight > 0; in_flight--)
+                    if (client.wait().status != STEP_OK)
+                        stats.errors++;
+            }
+        }
+
+        Clock::time_point sent = Clock::now();
+        if (client.step(0, n) != STEP_OK)
+            stats.errors++;
+        record_latency(stats, sent, n);
+        stats.steps += n;
+    }
+}
+
+
+/**
+ * @return The latency in microseconds that a fraction p of replies beat
+ */
+static double percentile(const std::vector<unsigned int> &histogram, double p)
+{
+    unsigned long total = 0;
+    for (unsigned int count : histogram)
+        total += count;
+
+    unsigned long rank = (unsigned long)(total * p);
+    unsigned long seen = 0;
+    for (size_t i = 0; i < histogram.size(); i++) {
+        seen += histogram[i];
+        if (seen > rank)
+            return i * LATENCY_RESOLUTION / 1000.0;
+    }
+    return histogram.size() * LATENCY_RESOLUTION / 1000.0;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *path = "/tmp/cf-step.sock";
+    const char *shm_name = nullptr;
+    int clients = 4;
+    int sessions = 256;
+    double seconds = 5;
+    int hz = 100;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--socket") && i + 1 < argc) {
+            path = argv[++i];
+        } else if (!strcmp(argv[i], "--shm") && i + 1 < argc) {
+            shm_name = argv[++i];
+        } else if (!strcmp(argv[i], "--clients") && i + 1 < argc) {
+            clients = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--sessions") && i + 1 < argc) {
+            sessions = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--seconds") && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--hz") && i + 1 < argc) {
+            hz = std::max(1, atoi(argv[++i]));
+        } else {
+            std::cerr << "usage: " << argv[0]
+                      << " [--socket PATH | --shm NAME] [--clients N] [--sessions N per client]"
+                         " [--seconds S] [--hz N]\n";
+            return 1;
+        }
+    }
+
+    pid_t pid;
+    if (shm_name != nullptr) {
+        ShmSegment segment;
+        if (!segment.open(shm_name))
+            return 1;
+        pid = segment.get_header()->server_pid;
+        sessions = std::min<int>(sessions, segment.get_header()->sessions);
+        clients = 1;
+    } else {
+        pid = server_pid(path);
+        if (pid == -1)
+            return 1;
+    }
+
+    std::vector<ClientStats> stats(clients);
+    std::vector<std::thread> threads;
+    std::atomic<bool> running(true);
+
+    double cpu_start = process_cpu_seconds(pid);
+    Clock::time_point start = Clock::now();
+
+    for (int i = 0; i < clients; i++) {
+        if (shm_name != nullptr)
+            threads.push_back(std::thread(run_shm_client, shm_name, sessions, 1000u * i,
+                                          std::cref(running), std::ref(stats[i])));
+        else
+            threads.push_back(std::thread(run_client, path, sessions, 1000u * i,
+                                          std::cref(running), std::ref(stats[i])));
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    running = false;
+    for (std::thread &t : threads)
+        t.join();
+
+    double wall = std::chrono::duration<double>(Clock::now() - start).count();
+    double cpu = process_cpu_seconds(pid) - cpu_start;
+
+    ClientStats total;
+    for (const ClientStats &s : stats) {
+        for (size_t i = 0; i < s.latency.size(); i++)
+            total.latency[i] += s.latency[i];
+        total.steps += s.steps;
+        total.resets += s.resets;
+        total.errors += s.errors;
+    }
+
+    double steps_per_second = total.steps / wall;
+
+    printf("%s, clients %d, sessions %d, %.1f s\n", shm_name ? "shm" : "socket",
+           clients, clients * sessions, wall);
+    printf("steps %lu (%.0f/s), resets %lu, errors %lu\n",
+           total.steps, steps_per_second, total.resets, total.errors);
+    printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f\n",
+           percentile(total.latency, 0.50),
+           percentile(total.latency, 0.90),
+           percentile(total.latency, 0.99),
+           percentile(total.latency, 0.999));
+
+    if (cpu > 0) {
+        printf("server cpu %.2f cores, %.0f steps per core-second, "
+               "%.0f sessions/core at %d Hz\n",
+               cpu / wall, total.steps / cpu, total.steps / cpu / hz, hz);
+    }
+
+    return total.errors ? 1 : 0;
+}